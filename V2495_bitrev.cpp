@@ -0,0 +1,142 @@
+#include "V2495_bitrev.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITREV_X86_GNUC
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define BITREV_X86_MSVC
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+// Byte bit reversal lookup table
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+
+static const uint8_t rev_table[256] = { R6(0), R6(2), R6(1), R6(3) };
+
+#undef R2
+#undef R4
+#undef R6
+
+typedef void (*bit_reverse_fn)(uint8_t *buf, size_t length);
+
+static void bit_reverse_table(uint8_t *buf, size_t length) {
+	for (size_t i = 0; i < length; i++)
+		buf[i] = rev_table[buf[i]];
+}
+
+#if defined(BITREV_X86_GNUC) || defined(BITREV_X86_MSVC)
+
+#ifdef BITREV_X86_GNUC
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+#else
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#endif
+
+// Nibble shuffle: each byte is split in two nibbles, each nibble is
+// reversed with a 16 entries table lookup (pshufb) and the two results
+// are swapped back together.
+//   rev(b) = rev4(b & 0xF) << 4 | rev4(b >> 4)
+TARGET_SSSE3
+static void bit_reverse_ssse3(uint8_t *buf, size_t length) {
+	const __m128i lo_table = _mm_setr_epi8(0x00, 0x80, 0x40, (char)0xC0, 0x20, (char)0xA0, 0x60, (char)0xE0,
+	                                       0x10, (char)0x90, 0x50, (char)0xD0, 0x30, (char)0xB0, 0x70, (char)0xF0);
+	const __m128i hi_table = _mm_setr_epi8(0x00, 0x08, 0x04, 0x0C, 0x02, 0x0A, 0x06, 0x0E,
+	                                       0x01, 0x09, 0x05, 0x0D, 0x03, 0x0B, 0x07, 0x0F);
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i lo = _mm_and_si128(v, mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		v = _mm_or_si128(_mm_shuffle_epi8(lo_table, lo), _mm_shuffle_epi8(hi_table, hi));
+		_mm_storeu_si128((__m128i *)(buf + i), v);
+	}
+
+	bit_reverse_table(buf + i, length - i);
+}
+
+TARGET_AVX2
+static void bit_reverse_avx2(uint8_t *buf, size_t length) {
+	const __m256i lo_table = _mm256_setr_epi8(0x00, 0x80, 0x40, (char)0xC0, 0x20, (char)0xA0, 0x60, (char)0xE0,
+	                                          0x10, (char)0x90, 0x50, (char)0xD0, 0x30, (char)0xB0, 0x70, (char)0xF0,
+	                                          0x00, 0x80, 0x40, (char)0xC0, 0x20, (char)0xA0, 0x60, (char)0xE0,
+	                                          0x10, (char)0x90, 0x50, (char)0xD0, 0x30, (char)0xB0, 0x70, (char)0xF0);
+	const __m256i hi_table = _mm256_setr_epi8(0x00, 0x08, 0x04, 0x0C, 0x02, 0x0A, 0x06, 0x0E,
+	                                          0x01, 0x09, 0x05, 0x0D, 0x03, 0x0B, 0x07, 0x0F,
+	                                          0x00, 0x08, 0x04, 0x0C, 0x02, 0x0A, 0x06, 0x0E,
+	                                          0x01, 0x09, 0x05, 0x0D, 0x03, 0x0B, 0x07, 0x0F);
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i lo = _mm256_and_si256(v, mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+		v = _mm256_or_si256(_mm256_shuffle_epi8(lo_table, lo), _mm256_shuffle_epi8(hi_table, hi));
+		_mm256_storeu_si256((__m256i *)(buf + i), v);
+	}
+
+	bit_reverse_table(buf + i, length - i);
+}
+
+static int cpu_has_ssse3() {
+#ifdef BITREV_X86_GNUC
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+#else
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] >> 9) & 1;
+#endif
+}
+
+static int cpu_has_avx2() {
+#ifdef BITREV_X86_GNUC
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	int info[4];
+	__cpuid(info, 1);
+	// OS must save the AVX registers (OSXSAVE and XCR0 bits 1-2)
+	if (!((info[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+#endif
+}
+
+#endif
+
+static const char *kernel_name = "table";
+
+static bit_reverse_fn select_kernel() {
+#if defined(BITREV_X86_GNUC) || defined(BITREV_X86_MSVC)
+	if (cpu_has_avx2()) {
+		kernel_name = "avx2";
+		return bit_reverse_avx2;
+	}
+	if (cpu_has_ssse3()) {
+		kernel_name = "ssse3";
+		return bit_reverse_ssse3;
+	}
+#endif
+	kernel_name = "table";
+	return bit_reverse_table;
+}
+
+void bit_reverse_buffer(uint8_t *buf, size_t length) {
+	static const bit_reverse_fn kernel = select_kernel();
+
+	kernel(buf, length);
+}
+
+const char *bit_reverse_kernel() {
+	bit_reverse_buffer(NULL, 0);
+	return kernel_name;
+}
@@ -0,0 +1,15 @@
+#ifndef V2495_BITREV_H
+#define V2495_BITREV_H
+
+#include <stdint.h> // for fixed-width integers
+#include <stddef.h>
+
+// Reverse the bit order of every byte of buf, in place.
+// The fastest kernel available on this CPU (AVX2, SSSE3 or a lookup
+// table) is selected at the first call.
+void bit_reverse_buffer(uint8_t *buf, size_t length);
+
+// Name of the kernel used by bit_reverse_buffer ("avx2", "ssse3" or "table")
+const char *bit_reverse_kernel();
+
+#endif
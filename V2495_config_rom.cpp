@@ -0,0 +1,173 @@
+#include "V2495_config_rom.h"
+#include "cvUpgradeV2495.h"
+
+#include <cstring>
+
+V2495_config_rom::V2495_config_rom(V2495_flash& flash) : flash(flash), flash_data(SIZE), data(SIZE)
+{
+	address = flash.get_config_rom_address();
+	invalidate();
+}
+
+void V2495_config_rom::invalidate()
+{
+	for (int i = 0; i < PAGES; i++) {
+		valid[i] = false;
+		dirty[i] = false;
+	}
+}
+
+int V2495_config_rom::dirty_pages() const
+{
+	int count = 0;
+
+	for (int i = 0; i < PAGES; i++) {
+		if (dirty[i])
+			count++;
+	}
+	return count;
+}
+
+void V2495_config_rom::check_range(uint32_t offset, uint32_t length)
+{
+	if (offset >= SIZE || length > SIZE - offset)
+		throw cuhRetCode_InvalidRegion;
+}
+
+void V2495_config_rom::load(uint32_t offset, uint32_t length)
+{
+	if (length == 0)
+		return;
+
+	for (uint32_t page = offset / PAGE_SIZE; page <= (offset + length - 1) / PAGE_SIZE; page++) {
+		if (valid[page])
+			continue;
+
+		flash.read_page(address + page * PAGE_SIZE, &flash_data[page * PAGE_SIZE]);
+		memcpy(&data[page * PAGE_SIZE], &flash_data[page * PAGE_SIZE], PAGE_SIZE);
+		valid[page] = true;
+	}
+}
+
+void V2495_config_rom::read(uint32_t offset, uint8_t *buf, uint32_t length)
+{
+	check_range(offset, length);
+	load(offset, length);
+	memcpy(buf, &data[offset], length);
+}
+
+void V2495_config_rom::write(uint32_t offset, const uint8_t *buf, uint32_t length)
+{
+	check_range(offset, length);
+	// Partial pages must be known, to program them back whole
+	load(offset, length);
+	memcpy(&data[offset], buf, length);
+
+	for (uint32_t page = offset / PAGE_SIZE; length > 0 && page <= (offset + length - 1) / PAGE_SIZE; page++)
+		dirty[page] = memcmp(&data[page * PAGE_SIZE], &flash_data[page * PAGE_SIZE], PAGE_SIZE) != 0;
+}
+
+uint8_t V2495_config_rom::get_u8(uint32_t offset)
+{
+	uint8_t value;
+
+	read(offset, &value, 1);
+	return value;
+}
+
+uint16_t V2495_config_rom::get_u16(uint32_t offset)
+{
+	uint8_t bytes[2];
+
+	read(offset, bytes, 2);
+	return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+uint32_t V2495_config_rom::get_u32(uint32_t offset)
+{
+	uint8_t bytes[4];
+
+	read(offset, bytes, 4);
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+std::string V2495_config_rom::get_string(uint32_t offset, uint32_t length)
+{
+	std::vector<uint8_t> bytes(length + 1, 0);
+
+	read(offset, &bytes[0], length);
+	return std::string((const char *)&bytes[0]);
+}
+
+void V2495_config_rom::set_u8(uint32_t offset, uint8_t value)
+{
+	write(offset, &value, 1);
+}
+
+void V2495_config_rom::set_u16(uint32_t offset, uint16_t value)
+{
+	uint8_t bytes[2] = { (uint8_t)value, (uint8_t)(value >> 8) };
+
+	write(offset, bytes, 2);
+}
+
+void V2495_config_rom::set_u32(uint32_t offset, uint32_t value)
+{
+	uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+
+	write(offset, bytes, 4);
+}
+
+void V2495_config_rom::set_string(uint32_t offset, uint32_t length, const std::string& value)
+{
+	std::vector<uint8_t> bytes(length + 1, 0);
+
+	memcpy(&bytes[0], value.c_str(), (value.size() < length) ? value.size() : length);
+	write(offset, &bytes[0], length);
+}
+
+void V2495_config_rom::commit()
+{
+	bool erase = false;
+
+	for (int page = 0; page < PAGES && !erase; page++) {
+		if (!dirty[page])
+			continue;
+		for (uint32_t i = page * PAGE_SIZE; i < (page + 1) * PAGE_SIZE; i++) {
+			if ((flash_data[i] & data[i]) != data[i]) {
+				erase = true;
+				break;
+			}
+		}
+	}
+
+	try {
+		if (erase) {
+			// The whole sector is read, erased and its pages programmed again
+			for (int page = 0; page < PAGES; page++) {
+				if (dirty[page])
+					flash.write_range(address + page * PAGE_SIZE, &data[page * PAGE_SIZE], PAGE_SIZE);
+			}
+			flash.flush();
+		}
+		else {
+			// Programming can only clear bits: the pages are programmed in place
+			for (int page = 0; page < PAGES; page++) {
+				if (dirty[page])
+					flash.write_page(address + page * PAGE_SIZE, &data[page * PAGE_SIZE]);
+			}
+		}
+	}
+	catch (cuhRetCode_t err) {
+		// The content of the flash is not known any more
+		invalidate();
+		throw;
+	}
+
+	for (int page = 0; page < PAGES; page++) {
+		if (dirty[page]) {
+			memcpy(&flash_data[page * PAGE_SIZE], &data[page * PAGE_SIZE], PAGE_SIZE);
+			dirty[page] = false;
+		}
+	}
+}
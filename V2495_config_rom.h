@@ -0,0 +1,68 @@
+#ifndef V2495_CONFIG_ROM_H
+#define V2495_CONFIG_ROM_H
+
+#include <stdint.h> // for fixed-width integers
+#include <string>
+#include <vector>
+#include "V2495_flash.h"
+
+// Configuration ROM of the main flash (sector 511, 64KB).
+//
+// Fields are read and written by offset in the sector. Only the pages
+// holding the requested fields are read from the flash, and they are
+// kept for the whole life of the object. Changes stay in the object
+// until commit(): pages where bits only go from 1 to 0 are programmed
+// again in place, and the sector is erased (and its other pages
+// rewritten) only if some bit has to go back to 1.
+//
+// Multi-byte fields are little endian.
+class V2495_config_rom
+{
+public:
+	const static uint32_t SIZE = 64 * 1024;
+	const static uint32_t PAGE_SIZE = 256;
+
+	// flash must be a main controller object
+	V2495_config_rom(V2495_flash& flash);
+
+	void read(uint32_t offset, uint8_t *buf, uint32_t length);
+	void write(uint32_t offset, const uint8_t *buf, uint32_t length);
+
+	uint8_t get_u8(uint32_t offset);
+	uint16_t get_u16(uint32_t offset);
+	uint32_t get_u32(uint32_t offset);
+	// length bytes, up to the first NUL
+	std::string get_string(uint32_t offset, uint32_t length);
+
+	void set_u8(uint32_t offset, uint8_t value);
+	void set_u16(uint32_t offset, uint16_t value);
+	void set_u32(uint32_t offset, uint32_t value);
+	// value is cut or padded with NULs to length bytes
+	void set_string(uint32_t offset, uint32_t length, const std::string& value);
+
+	// Write the changed pages to the flash
+	void commit();
+	// Forget the pages read so far (e.g. the ROM was changed by someone else)
+	void invalidate();
+
+	// Pages changed and not yet committed
+	int dirty_pages() const;
+
+private:
+	const static int PAGES = SIZE / PAGE_SIZE;
+
+	V2495_flash& flash;
+	uint32_t address; // of the sector
+
+	std::vector<uint8_t> flash_data; // content of the flash (valid pages)
+	std::vector<uint8_t> data;       // content with the changes
+	bool valid[PAGES];
+	bool dirty[PAGES];
+
+	// Throws cuhRetCode_InvalidRegion if the range is outside the ROM
+	void check_range(uint32_t offset, uint32_t length);
+	// Read the pages of the range that are not cached yet
+	void load(uint32_t offset, uint32_t length);
+};
+
+#endif
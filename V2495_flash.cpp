@@ -1,56 +1,120 @@
 #include "V2495_flash.h"
 #include "CAENComm.h"
 #include "cvUpgradeV2495.h"
+#include "V2495_bitrev.h"
+#include "V2495_stats.h"
+#include "V2495_journal.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <fstream>
 #include <cstring>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <random>
 
 #ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <dirent.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#define stat _stat // struct and function
 #endif
 
 V2495_flash::V2495_flash(controller_t controller_offset)
 {
-	uint32_t idcode;
-	int32_t ret;
-
-	handle = -1;
-	
 	/* Connection to target module 
 	**  Please change VME Base address accordingly to your setup:
 	**  i.e. for a VME Base address = 0x32100000 call:
-	**  CAENComm_OpenDevice(CAENComm_USB, 0, 0, 0x32100000, &handle);
+	**  new V2495_CAENComm_transport(CAENComm_USB, 0, 0, 0x32100000);
 	*/
-	ret = CAENComm_OpenDevice(CAENComm_USB, 0, 0, 0, &handle);
-	if (ret != CAENComm_Success) {
-		fprintf(stderr, "Device open failed with CAENComm error %d.\n", ret);
-		throw cuhRetCode_Open;
-	}
-	
+	transport = new V2495_CAENComm_transport(CAENComm_USB, 0, 0, 0);
+	own_transport = 1;
+
+	init(controller_offset);
+}
+
+V2495_flash::V2495_flash(controller_t controller_offset, const V2495_target_t& target)
+{
+	transport = new V2495_CAENComm_transport(target);
+	own_transport = 1;
+
+	init(controller_offset);
+}
+
+V2495_flash::V2495_flash(controller_t controller_offset, V2495_transport *transport)
+{
+	this->transport = transport;
+	own_transport = 0;
+
+	init(controller_offset);
+}
+
+void V2495_flash::init(controller_t controller_offset)
+{
+	uint32_t idcode;
+
+	bitstream = NULL;
+	bitstream_length = 0;
+	bitstream_mapped = 0;
+	bitstream_reversed = 0;
+	bitstream_mtime = 0;
+
+	log_prefix[0] = '\0';
+	log_stream = NULL;
+	flash_access = 0;
+	boot_unprotected = 0;
+
+	differential_mode = 0;
+	transfer_mode = TRANSFER_BLT;
+
+	max_retries = 5;
+	retries = 0;
+
+	journal = NULL;
+	journal_resume = 0;
+	shadow = NULL;
+	journal_key[0] = '\0';
+	batch_commands = 1;
+
+	// Typical times of the flash (the maximum ones are a few times longer);
+	// timeouts leave a wide margin for the link latency.
+	flash_timing[FLASH_OP_PAGE_PROGRAM].expected_us = 500;
+	flash_timing[FLASH_OP_PAGE_PROGRAM].timeout_us = 200000;
+	flash_timing[FLASH_OP_SECTOR_ERASE].expected_us = 500000;
+	flash_timing[FLASH_OP_SECTOR_ERASE].timeout_us = 10000000;
+	flash_timing[FLASH_OP_STATUS_WRITE].expected_us = 2000;
+	flash_timing[FLASH_OP_STATUS_WRITE].timeout_us = 1000000;
+
 	try {
 		switch (controller_offset) {
 		case MAIN_CONTROLLER_OFFSET:
 			controller_base_address = MAIN_CONTROLLER_OFFSET;
-			bitstream_length = MAIN_FIRMWARE_BITSTREAM_LENGTH;
 			break;
 	    case USER_CONTROLLER_OFFSET:
 		    controller_base_address = USER_CONTROLLER_OFFSET;
-		    bitstream_length = USER_FIRMWARE_BITSTREAM_LENGTH;
 		    break;
 
 		default:
 			break;
 		}
 
-		bitstream = new uint8_t[bitstream_length];
-		if (bitstream == NULL)
-			throw cuhRetCode_Memory;
+		health_check = 0;
+		health_address = 0;
+		health_mask = 0;
+		health_value = 0;
 
 		// If the controller is accessible
 		// we must be able to read a unique IDCODE
@@ -62,10 +126,7 @@ V2495_flash::V2495_flash(controller_t controller_offset)
 			_flash_controller_present = 1;
 
 		// MUST enable flash access from controller!
-		enable_flash_access(); // HACK giusto farlo nel costruttore????
-
-		// Sblocca accesso al controllore flash
-		WriteRegister(controller_base_address + UNLOCK_OFFSET, 0xABBA5511);
+		acquire_flash_access(); // HACK giusto farlo nel costruttore????
 	}
 	catch (cuhRetCode_t err) {
 		closeDevice();
@@ -77,8 +138,21 @@ V2495_flash::V2495_flash(controller_t controller_offset)
 V2495_flash::~V2495_flash()
 {
 	// MUST disable flash access from controller!
-	disable_flash_access(); // HACK giusto farlo nel distruttore?
+	// A link error can't be propagated from here
+	try {
+		flush();
+		release_flash_access(); // HACK giusto farlo nel distruttore?
+	}
+	catch (cuhRetCode_t err) {
+		message(stderr, "Error %d disabling flash access.\n", err);
+	}
 	closeDevice();
+	unload_bitstream();
+
+	if (journal != NULL)
+		delete journal;
+	if (shadow != NULL)
+		delete shadow;
 }
 
 void V2495_flash::get_flash_status(uint32_t * status)
@@ -93,24 +167,182 @@ void V2495_flash::get_flash_status(uint32_t * status)
 }
 
 
-void V2495_flash::load_bitstream_from_file(char *filename) {
-	printf("Opening %s\n", filename);
-	ifstream bitstream_file(filename, ios::in | ios::binary);
+void V2495_flash::load_bitstream_from_file(char *filename, int no_bit_reverse) {
+	struct stat st;
+
+	// The same image, unchanged, is already loaded
+	if (bitstream != NULL && bitstream_file == filename && bitstream_reversed == !no_bit_reverse &&
+	    stat(filename, &st) == 0 && st.st_size == bitstream_length && st.st_mtime == bitstream_mtime)
+		return;
+
+	unload_bitstream();
 
-	if (!(bitstream_file.is_open())) {
-		fprintf(stderr, "Can't open file %s.\n", filename);
+	message(stdout, "Opening %s\n", filename);
+
+#ifndef WIN32
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0) {
+		message(stderr, "Can't open file %s.\n", filename);
 		throw cuhRetCode_FileOpen;
 	}
-	
-	if (!(bitstream_file.read((char *)bitstream, bitstream_length))) { // HACK conversione uint8_t * => char *
-		printf("Error reading file: different length from expected.\n");
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > 0x7FFFFFFF) {
+		close(fd);
+		message(stdout, "Error reading file: invalid length.\n");
 		throw cuhRetCode_InvalidFile;
 	}
-	
-	if (!bitstream) {
-		printf("Can't initialize bitstream.\n");
+
+	// Private mapping: the in place bit reversal below doesn't touch the file
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		message(stdout, "Can't initialize bitstream.\n");
+		throw cuhRetCode_Memory;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	bitstream = (uint8_t *)map;
+	bitstream_length = (int)st.st_size;
+	bitstream_mapped = 1;
+	bitstream_mtime = st.st_mtime;
+#else
+	ifstream image_file(filename, ios::in | ios::binary | ios::ate);
+
+	if (!(image_file.is_open())) {
+		message(stderr, "Can't open file %s.\n", filename);
+		throw cuhRetCode_FileOpen;
+	}
+
+	bitstream_length = (int)image_file.tellg();
+	if (bitstream_length <= 0) {
+		bitstream_length = 0;
+		message(stdout, "Error reading file: invalid length.\n");
+		throw cuhRetCode_InvalidFile;
+	}
+	image_file.seekg(0, ios::beg);
+
+	bitstream = new uint8_t[bitstream_length];
+	bitstream_mapped = 0;
+	bitstream_mtime = (stat(filename, &st) == 0) ? st.st_mtime : 0;
+
+	if (!(image_file.read((char *)bitstream, bitstream_length))) { // HACK conversione uint8_t * => char *
+		unload_bitstream();
+		message(stdout, "Error reading file.\n");
+		throw cuhRetCode_InvalidFile;
+	}
+#endif
+
+	// Reverse the whole bitstream once here: page loops copy it as it is
+	if (!no_bit_reverse)
+		bit_reverse_buffer(bitstream, bitstream_length);
+
+#ifndef WIN32
+	// From now on the image is only read (and may be shared by several regions)
+	if (bitstream_mapped)
+		mprotect(bitstream, bitstream_length, PROT_READ);
+#endif
+
+	bitstream_file = filename;
+	bitstream_reversed = !no_bit_reverse;
+}
+
+void V2495_flash::unload_bitstream() {
+	if (bitstream == NULL)
+		return;
+
+#ifndef WIN32
+	if (bitstream_mapped)
+		munmap(bitstream, bitstream_length);
+	else
+#endif
+		delete[] bitstream;
+
+	bitstream = NULL;
+	bitstream_length = 0;
+	bitstream_mapped = 0;
+	bitstream_file.clear();
+}
+
+int V2495_flash::image_sectors(int region_sectors) {
+	int sectors = (bitstream_length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+	if (sectors > region_sectors) {
+		message(stderr, "Firmware image of %d bytes doesn't fit in the region (%d sectors).\n", bitstream_length, region_sectors);
 		throw cuhRetCode_InvalidFile;
 	}
+	return sectors;
+}
+
+static const char *region_names[] = { "boot", "app1", "app2", "app3", "app4", "app5" };
+
+int V2495_flash::parse_region(const char *name, fw_region_t *region) {
+	for (int i = BOOT_FW_REGION; i <= APPLICATION5_FW_REGION; i++) {
+		if (strcmp(name, region_names[i]) == 0) {
+			*region = (fw_region_t)i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+const char *V2495_flash::region_name(fw_region_t region) {
+	if (region < BOOT_FW_REGION || region > APPLICATION5_FW_REGION)
+		return "?";
+	return region_names[region];
+}
+
+void V2495_flash::get_region(fw_region_t region, uint32_t *start_address, int *sectors) {
+	switch (controller_base_address) {
+	case MAIN_CONTROLLER_OFFSET:
+		*sectors = MAIN_FIRMWARE_SECTORS;
+
+		switch (region) {
+		case BOOT_FW_REGION:
+			*start_address = MAIN_FACTORY_START_ADDRESS;
+			break;
+		case APPLICATION1_FW_REGION:
+			*start_address = MAIN_APPLICATION_START_ADDRESS;
+			break;
+		default:
+			throw cuhRetCode_InvalidRegion;
+			break;
+		}
+		break;
+
+	case USER_CONTROLLER_OFFSET:
+		*sectors = USER_FIRMWARE_SECTORS;
+
+		switch (region) {
+		case BOOT_FW_REGION:
+			*start_address = USER_FACTORY_START_ADDRESS;
+			break;
+		case APPLICATION1_FW_REGION:
+			*start_address = USER_APPLICATION1_START_ADDRESS;
+			break;
+		case APPLICATION2_FW_REGION:
+			*start_address = USER_APPLICATION2_START_ADDRESS;
+			break;
+		case APPLICATION3_FW_REGION:
+			*start_address = USER_APPLICATION3_START_ADDRESS;
+			break;
+		case APPLICATION4_FW_REGION:
+			*start_address = USER_APPLICATION4_START_ADDRESS;
+			break;
+		case APPLICATION5_FW_REGION:
+			*start_address = USER_APPLICATION5_START_ADDRESS;
+			break;
+		default:
+			throw cuhRetCode_InvalidRegion;
+			break;
+		}
+		break;
+
+	default:
+		throw cuhRetCode_InvalidController;
+		break;
+	}
 }
 
 void V2495_flash::get_controller_status(uint32_t * status)
@@ -122,78 +354,309 @@ void V2495_flash::get_controller_status(uint32_t * status)
 }
 
 void V2495_flash::sector_erase(uint32_t start_address)
+{
+	for (int attempt = 0; ; attempt++) {
+		try {
+			start_sector_erase(start_address);
+			wait_flash(FLASH_OP_SECTOR_ERASE);
+			return;
+		}
+		catch (cuhRetCode_t err) {
+			if (err != cuhRetCode_Comm || !retry_wait(attempt, "Sector erase", err))
+				throw;
+		}
+		// Erasing again is harmless, whether the erase was done or not
+		recover_controller(FLASH_OP_SECTOR_ERASE);
+	}
+}
+
+void V2495_flash::start_sector_erase(uint32_t start_address)
 {
 	if (!_flash_controller_present)
 		throw cuhRetCode_ControllerNotPresent;
 
-	WriteRegister(controller_base_address + ADDRESS_OFFSET, start_address);
-	WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
-	WriteRegister(controller_base_address + OPCODE_OFFSET, SECTOR_ERASE_OPCODE);
+	cmd_batch batch(controller_base_address);
+
+	batch.add(ADDRESS_OFFSET, start_address);
+	batch.add(OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
+	batch.add(OPCODE_OFFSET, SECTOR_ERASE_OPCODE);
+	submit(batch);
+}
 
-	wait_flash();
+// True if all the bytes are in the erased state (0xFF)
+static int is_blank(const uint8_t *buf, uint32_t length) {
+	for (uint32_t i = 0; i < length; ++i) {
+		if (buf[i] != 0xFF)
+			return 0;
+	}
+	return 1;
 }
 
+// Set a page to 0xFF, leaving the rest of the sector as it is
 void V2495_flash::page_erase(uint32_t start_address)
 {
-	uint32_t sector_address;
-	uint8_t *buf = new uint8_t[SECTOR_SIZE];
-	uint8_t *buf1 = new uint8_t[SECTOR_SIZE];
-	uint32_t pageOffset;
+	uint8_t page[PAGE_SIZE];
+
+	memset(page, 0xFF, PAGE_SIZE);
+	write_range(((uint32_t)(start_address / PAGE_SIZE)) * PAGE_SIZE, page, PAGE_SIZE);
+	flush();
+}
 
+void V2495_flash::write_range(uint32_t address, const uint8_t *data, uint32_t length)
+{
 	if (!_flash_controller_present)
 		throw cuhRetCode_ControllerNotPresent;
 
+	while (length > 0) {
+		uint32_t sector_address = ((uint32_t)(address / SECTOR_SIZE)) * SECTOR_SIZE;
+		uint32_t offset = address - sector_address;
+		uint32_t bytes = SECTOR_SIZE - offset;
+		cached_sector_t *sector = cache_sector(sector_address);
+
+		if (bytes > length)
+			bytes = length;
+
+		memcpy(&sector->data[offset], data, bytes);
+		sector->dirty = 1;
+
+		address += bytes;
+		data += bytes;
+		length -= bytes;
+	}
+}
+
+V2495_flash::cached_sector_t *V2495_flash::cache_sector(uint32_t sector_address)
+{
+	for (size_t i = 0; i < sector_cache.size(); ++i) {
+		if (sector_cache[i].address == sector_address)
+			return &sector_cache[i];
+	}
+
+	// Cache full: the oldest sector is written and dropped
+	if (sector_cache.size() >= SECTOR_CACHE_SECTORS) {
+		commit_sector(sector_cache[0]);
+		sector_cache.erase(sector_cache.begin());
+	}
+
+	cached_sector_t sector;
+
+	sector.address = sector_address;
+	sector.flash.resize(SECTOR_SIZE);
+	read_sector(sector_address, &sector.flash[0]);
+	sector.data = sector.flash;
+	sector.dirty = 0;
+	sector_cache.push_back(sector);
+
+	return &sector_cache.back();
+}
+
+void V2495_flash::commit_sector(cached_sector_t& sector)
+{
+	int erase = 0;
+
+	if (!sector.dirty)
+		return;
+
+	// Programming can only clear bits: the sector must be erased only if
+	// some bit has to go from 0 back to 1
+	for (uint32_t i = 0; i < SECTOR_SIZE && !erase; ++i) {
+		if ((sector.flash[i] & sector.data[i]) != sector.data[i])
+			erase = 1;
+	}
+
+	if (erase) {
+		sector_erase(sector.address);
+		memset(&sector.flash[0], 0xFF, SECTOR_SIZE);
+	}
+
+	// Only the pages that differ from the flash content are programmed
+	for (uint32_t offset = 0; offset < SECTOR_SIZE; offset += PAGE_SIZE) {
+		if (memcmp(&sector.flash[offset], &sector.data[offset], PAGE_SIZE) == 0)
+			continue;
+
+		write_page(sector.address + offset, &sector.data[offset]);
+		memcpy(&sector.flash[offset], &sector.data[offset], PAGE_SIZE);
+	}
+	sector.dirty = 0;
+}
+
+void V2495_flash::flush()
+{
 	try {
-		sector_address = ((uint32_t)(start_address / SECTOR_SIZE)) * SECTOR_SIZE;
-		pageOffset = start_address - sector_address;
-		read_sector(sector_address, buf);
-		sector_erase(sector_address);
-		read_sector(sector_address, buf1);
-		// write 1 on the selected page in the buffer
-		memset(buf + pageOffset, 0xFF, PAGE_SIZE);
-		write_sector(sector_address, buf);
+		for (size_t i = 0; i < sector_cache.size(); ++i)
+			commit_sector(sector_cache[i]);
 	}
 	catch (cuhRetCode_t err) {
-		if (buf != NULL)
-			delete[] buf;
-		if (buf1 != NULL)
-			delete[] buf1;
+		// The flash content is not known any more
+		sector_cache.clear();
 		throw;
 	}
-	if (buf != NULL)
-		delete[] buf;
-	if (buf1 != NULL)
-		delete[] buf1;
+	// The flash can be changed by other operations: don't keep stale copies
+	sector_cache.clear();
 }
 
 
-void V2495_flash::write_page(uint32_t start_address, uint8_t  *buf)
+void V2495_flash::write_page(uint32_t start_address, uint8_t  *buf, uint32_t length)
+{
+	for (int attempt = 0; ; attempt++) {
+		try {
+			start_write_page(start_address, buf, length);
+			wait_flash(FLASH_OP_PAGE_PROGRAM);
+			return;
+		}
+		catch (cuhRetCode_t err) {
+			if (err != cuhRetCode_Comm || !retry_wait(attempt, "Page program", err))
+				throw;
+		}
+		// The page may have been programmed, or partially programmed
+		if (page_programmed(start_address, buf, length))
+			return;
+	}
+}
+
+int V2495_flash::page_programmed(uint32_t start_address, const uint8_t *buf, uint32_t length)
+{
+	uint8_t page[PAGE_SIZE];
+
+	recover_controller(FLASH_OP_PAGE_PROGRAM);
+	read_page(start_address, page);
+
+	if (memcmp(page, buf, length) == 0)
+		return 1;
+
+	// Programming can only clear bits: it can be replayed if no bit that
+	// must stay at 1 has already been cleared (blank or partially
+	// programmed page).
+	for (uint32_t i = 0; i < length; i++) {
+		if ((page[i] & buf[i]) != buf[i]) {
+			message(stderr, "Page 0x%X holds different data, can't program it again.\n", start_address);
+			throw cuhRetCode_Write;
+		}
+	}
+	return 0;
+}
+
+void V2495_flash::recover_controller(flash_op_t op)
+{
+	flash_timing_t *timing = &flash_timing[op];
+	uint32_t backoff_us = POLL_MIN_BACKOFF_US;
+	std::chrono::steady_clock::time_point start;
+
+	// The command may have been cut in the middle: if the controller
+	// doesn't get ready its state is unknown, reset it.
+	try {
+		wait_controller();
+	}
+	catch (cuhRetCode_t err) {
+		if (err != cuhRetCode_Timeout)
+			throw;
+		message(stderr, "Resetting the flash controller.\n");
+		WriteRegister(controller_base_address + OPCODE_OFFSET, RESET_CONTROLLER_OPCODE);
+		wait_controller();
+	}
+
+	// Let a flash operation that was started complete
+	start = std::chrono::steady_clock::now();
+	while (!flash_ready()) {
+		if (std::chrono::steady_clock::now() - start > std::chrono::microseconds(timing->timeout_us)) {
+			message(stderr, "Flash still busy after %u ms.\n", timing->timeout_us / 1000);
+			throw cuhRetCode_Timeout;
+		}
+		sleep_us(backoff_us);
+		if (backoff_us < timing->expected_us / 4)
+			backoff_us *= 2;
+	}
+}
+
+int V2495_flash::retry_wait(int attempt, const char *what, int32_t error)
+{
+	uint32_t backoff_us = RETRY_MAX_BACKOFF_US;
+
+	if (attempt >= max_retries)
+		return 0;
+
+	// Shift only while it can't overflow
+	if (attempt <= 16 && (RETRY_BACKOFF_US << attempt) < RETRY_MAX_BACKOFF_US)
+		backoff_us = RETRY_BACKOFF_US << attempt;
+
+	retries++;
+	message(stderr, "%s failed with error %d, retry %i of %i.\n", what, error, attempt + 1, max_retries);
+	sleep_us(backoff_us);
+	return 1;
+}
+
+int V2495_flash::is_idempotent(uint32_t address, uint32_t data)
+{
+	uint32_t offset = address - controller_base_address;
+
+	if (offset == REBOOT_OFFSET)
+		return 0;
+	if (offset != OPCODE_OFFSET)
+		return 1;
+
+	// Commands that can be sent twice with the same result
+	switch (data) {
+	case RESET_CONTROLLER_OPCODE:
+	case WRITE_ENABLE_OPCODE:
+	case READ_STATUS_OPCODE:
+	case READ_PAGE_OPCODE:
+	case NOP_OPCODE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+void V2495_flash::set_retries(int count) {
+	max_retries = (count < 0) ? 0 : count;
+}
+
+void V2495_flash::start_write_page(uint32_t start_address, const uint8_t *buf, uint32_t length)
 {
-	uint32_t addrs[64];
 	uint32_t datas[64];
+	int words = (length + 3) / 4;
+	cmd_batch batch(controller_base_address);
 
 	if (!_flash_controller_present)
 		throw cuhRetCode_ControllerNotPresent;
 
-	WriteRegister(controller_base_address + ADDRESS_OFFSET, start_address);
-	WriteRegister(controller_base_address + PAYLOAD_OFFSET, 255); // 256 bytes payload
-
-	for (int i = 0; i < 64; ++i) {
-		addrs[i] = controller_base_address + BRAM_START_OFFSET + 4 * i;
-		datas[i] = *((uint32_t *)buf + i);
-	}
+	if (length == 0 || length > PAGE_SIZE)
+		throw cuhRetCode_Write;
 
-	MultiWriteRegister(64, addrs, datas);
+	batch.add(ADDRESS_OFFSET, start_address);
+	batch.add(PAYLOAD_OFFSET, length - 1); // up to 256 bytes payload
 
-	WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
+	// Bytes past length in the last word are sent as 0xFF,
+	// they are not programmed anyway.
+	datas[words - 1] = 0xFFFFFFFF;
+	std::memcpy(datas, buf, length);
 
-	WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_PAGE_OPCODE);
+	for (int i = 0; i < words; ++i)
+		batch.add(BRAM_START_OFFSET + 4 * i, datas[i]);
 
-	wait_flash();
+	batch.add(OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
+	batch.add(OPCODE_OFFSET, WRITE_PAGE_OPCODE);
+	submit(batch);
 }
 
 
 void V2495_flash::read_page(uint32_t start_address, uint8_t*  buf)
+{
+	// All the steps of a read can be repeated
+	for (int attempt = 0; ; attempt++) {
+		try {
+			read_page_once(start_address, buf);
+			return;
+		}
+		catch (cuhRetCode_t err) {
+			if (err != cuhRetCode_Comm || !retry_wait(attempt, "Page read", err))
+				throw;
+		}
+		recover_controller(FLASH_OP_PAGE_PROGRAM);
+	}
+}
+
+void V2495_flash::read_page_once(uint32_t start_address, uint8_t*  buf)
 {
 	uint32_t addrs[64];
 	uint32_t datas[64];
@@ -201,17 +664,20 @@ void V2495_flash::read_page(uint32_t start_address, uint8_t*  buf)
 	if (!_flash_controller_present)
 		throw cuhRetCode_ControllerNotPresent;
 
-	WriteRegister(controller_base_address + ADDRESS_OFFSET, start_address);
-	WriteRegister(controller_base_address + PAYLOAD_OFFSET, PAGE_SIZE - 1); // 256 bytes payload
-
+	cmd_batch batch(controller_base_address);
 
-	WriteRegister(controller_base_address + OPCODE_OFFSET, READ_PAGE_OPCODE);
+	batch.add(ADDRESS_OFFSET, start_address);
+	batch.add(PAYLOAD_OFFSET, PAGE_SIZE - 1); // 256 bytes payload
+	batch.add(OPCODE_OFFSET, READ_PAGE_OPCODE);
+	submit(batch);
 
 	wait_controller();
 
-	// HACK implementare con MultiRead32/BLT
-	//for (int i = 0; i < 64; ++i)
-	//	ReadRegister(controller_base_address + BRAM_START_OFFSET + 4 * i, (uint32_t *)buf + i);
+	if (transfer_mode != TRANSFER_MULTIREAD &&
+	    BlockReadRegister(controller_base_address + BRAM_START_OFFSET, 64, datas)) {
+		std::memcpy(buf, datas, 64 * sizeof(uint32_t));
+		return;
+	}
 
 	for (int i = 0; i < 64; ++i) {
 		addrs[i] = controller_base_address + BRAM_START_OFFSET + 4 * i;
@@ -244,8 +710,11 @@ void V2495_flash::set_flash_status(uint8_t status)
 	if (!_flash_controller_present)
 		throw cuhRetCode_ControllerNotPresent;
 
-	WriteRegister(controller_base_address + ADDRESS_OFFSET, (uint32_t)status);
-	WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_STATUS_OPCODE);
+	cmd_batch batch(controller_base_address);
+
+	batch.add(ADDRESS_OFFSET, (uint32_t)status);
+	batch.add(OPCODE_OFFSET, WRITE_STATUS_OPCODE);
+	submit(batch);
 }
 
 
@@ -253,23 +722,47 @@ void V2495_flash::set_flash_status(uint8_t status)
 void V2495_flash::wait_controller()
 {
 	uint32_t data;
+	uint32_t backoff_us = POLL_MIN_BACKOFF_US;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-
-	while (1) { // TODO potential deadlock!!! => timeout
+	while (1) {
 
 		// Attende che il controllore flash sia pronto ad accettare un nuovo comando
 		ReadRegister(controller_base_address + OPCODE_OFFSET, &data);
+		STATS_POLLS(OP_WAIT_CONTROLLER, 1);
 		if ((data & 0xFE) == 0) 
 			break;
+
+		if (std::chrono::steady_clock::now() - start > std::chrono::microseconds(CONTROLLER_TIMEOUT_US)) {
+			message(stderr, "Flash controller still busy after %u ms (0x%X).\n", CONTROLLER_TIMEOUT_US / 1000, data);
+			throw cuhRetCode_Timeout;
+		}
+
+		// Controller commands are short: back off slowly
+		sleep_us(backoff_us);
+		if (backoff_us < 1000)
+			backoff_us *= 2;
 	}
+
+	STATS_RECORD(OP_WAIT_CONTROLLER, 0, start);
 }
 
 
-void V2495_flash::wait_flash()
+void V2495_flash::wait_flash(flash_op_t op)
 {
 	uint32_t data;
+	flash_timing_t *timing = &flash_timing[op];
+	uint32_t backoff_us = POLL_MIN_BACKOFF_US;
+	uint32_t max_backoff_us = timing->expected_us / 4;
+	uint32_t elapsed_us;
+	uint32_t last_busy_us = 0;
+	int polls = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Most of the operation time is spent sleeping instead of polling
+	sleep_us(timing->expected_us * 3 / 4);
 
-	while (1) { //  TODO potential deadlock!!! => timeout
+	while (1) {
 
 		// Attende che il controllore della flash abbia terminato una eventuale 
 		// operazione in corso.
@@ -279,273 +772,1008 @@ void V2495_flash::wait_flash()
 		// abbia finito l'operazione di scrittura.
 		WriteRegister(controller_base_address + OPCODE_OFFSET, READ_STATUS_OPCODE);
 		ReadRegister(controller_base_address + OPCODE_OFFSET, &data);
+
+		elapsed_us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		polls++;
+
 		if (((data >> 8) & 1) == 0)
-			return;
+			break;
+
+		if (elapsed_us > timing->timeout_us) {
+			message(stderr, "Flash still busy after %u ms (status 0x%X).\n", timing->timeout_us / 1000, (data >> 8) & 0xFF);
+			throw cuhRetCode_Timeout;
+		}
+		last_busy_us = elapsed_us;
+
+		// Exponential backoff, up to a fraction of the expected time
+		sleep_us(backoff_us);
+		if (backoff_us < max_backoff_us)
+			backoff_us *= 2;
 	}
 
-	return;
+	STATS_POLLS(OP_WAIT_FLASH, polls);
+	STATS_RECORD(OP_WAIT_FLASH, 0, start);
+
+	learn_timing(op, polls, last_busy_us, elapsed_us);
+}
+
+void V2495_flash::learn_timing(flash_op_t op, int polls, uint32_t last_busy_us, uint32_t elapsed_us)
+{
+	flash_timing_t *timing = &flash_timing[op];
+
+	// Learn the timing of this flash. Done at the first poll only tells that
+	// the operation is shorter than expected (an upper bound, as the first
+	// poll comes after 3/4 of the expected time): halve the estimate, so a
+	// much faster flash is found in a few operations. Otherwise the end is
+	// between the last two polls.
+	if (polls == 1)
+		timing->expected_us = (elapsed_us < timing->expected_us / 2) ? elapsed_us : timing->expected_us / 2;
+	else
+		timing->expected_us = (3 * timing->expected_us + (last_busy_us + elapsed_us) / 2) / 4;
+}
+
+int V2495_flash::flash_ready()
+{
+	uint32_t data;
+
+	wait_controller();
+
+	WriteRegister(controller_base_address + OPCODE_OFFSET, READ_STATUS_OPCODE);
+	ReadRegister(controller_base_address + OPCODE_OFFSET, &data);
+
+	return ((data >> 8) & 1) == 0;
 }
 
-uint8_t  inline V2495_flash::rev_byte(uint8_t v) {
-	uint8_t t = v;
-	for (int i = sizeof(v) * 8 - 1; i; i--)
+// Compares the sectors read back from the flash with the image in a
+// worker thread, so that the comparison runs while the link is busy with
+// the next sector. Two sector buffers are used in turn.
+class sector_comparer
+{
+public:
+	sector_comparer(const uint8_t *image, int image_length, uint32_t sector_size, uint32_t page_size) :
+		image(image), image_length(image_length), sector_size(sector_size), page_size(page_size),
+		next_buffer(0), stop(false)
 	{
-		t <<= 1;
-		v >>= 1;
-		t |= v & 1;
+		for (int i = 0; i < BUFFERS; i++) {
+			buffers[i].resize(sector_size);
+			sectors[i] = -1;
+		}
+		worker = std::thread(&sector_comparer::run, this);
 	}
-	return t;
-}
 
+	~sector_comparer() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+			changed.notify_all();
+		}
+		worker.join();
+	}
 
-void V2495_flash::program_firmware(fw_region_t region, char *filename, int verify, int no_bit_reverse, int skip_erase) {
+	// Next buffer to fill, once the worker is done with it
+	uint8_t *get_buffer() {
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [&]() { return sectors[next_buffer] < 0; });
+		return &buffers[next_buffer][0];
+	}
 
-	uint8_t * buf;
-	uint8_t * buf_ver;
-	int sectors_to_write;
-	int bytes_to_write;
-	uint32_t start_address;
-	
-	buf = new uint8_t[PAGE_SIZE];
-	buf_ver = new uint8_t[PAGE_SIZE];
-	
-	load_bitstream_from_file(filename);
+	// Queue the buffer returned by get_buffer, holding sector
+	void submit(int sector) {
+		std::lock_guard<std::mutex> guard(lock);
+		sectors[next_buffer] = sector;
+		next_buffer = (next_buffer + 1) % BUFFERS;
+		changed.notify_all();
+	}
 
-	switch (controller_base_address) {
-	case MAIN_CONTROLLER_OFFSET:
-		sectors_to_write = MAIN_FIRMWARE_SECTORS;
+	// Wait for the queued sectors; offsets (in the image) of the pages that differ
+	void finish(std::vector<int>& bad_pages) {
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [&]() { return sectors[0] < 0 && sectors[1] < 0; });
+		std::sort(mismatches.begin(), mismatches.end());
+		bad_pages = mismatches;
+	}
 
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = MAIN_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = MAIN_APPLICATION_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION3_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION4_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION5_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		default:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		}
-
-		break;
+private:
+	const static int BUFFERS = 2;
+
+	const uint8_t *image;
+	int image_length;
+	uint32_t sector_size;
+	uint32_t page_size;
+
+	std::vector<uint8_t> buffers[BUFFERS];
+	int sectors[BUFFERS]; // sector in each buffer, -1: free
+	int next_buffer;      // next buffer to fill
+	bool stop;
+	std::vector<int> mismatches;
+
+	std::mutex lock;
+	std::condition_variable changed;
+	std::thread worker;
+
+	void run() {
+		int current = 0;
+
+		while (1) {
+			int sector;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard, [&]() { return sectors[current] >= 0 || stop; });
+				if (sectors[current] < 0)
+					return;
+				sector = sectors[current];
+			}
 
-	case USER_CONTROLLER_OFFSET:
-		sectors_to_write = USER_FIRMWARE_SECTORS;
+			// memcmp works on whole words (SIMD in the C library);
+			// only the pages that differ are looked at one by one
+			std::vector<int> bad;
+			int offset = sector * sector_size;
+			int length = image_length - offset;
+			const uint8_t *data = &buffers[current][0];
+
+			if (length > (int)sector_size)
+				length = sector_size;
+			if (length > 0 && memcmp(data, image + offset, length) != 0) {
+				for (int page = 0; page < length; page += page_size) {
+					int bytes = (length - page < (int)page_size) ? length - page : page_size;
+
+					if (memcmp(data + page, image + offset + page, bytes) != 0)
+						bad.push_back(offset + page);
+				}
+			}
 
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = USER_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = USER_APPLICATION1_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			start_address = USER_APPLICATION2_START_ADDRESS;
-			break;
-		case APPLICATION3_FW_REGION:
-			start_address = USER_APPLICATION3_START_ADDRESS;
-			break;
-		case APPLICATION4_FW_REGION:
-			start_address = USER_APPLICATION4_START_ADDRESS;
-			break;
-		case APPLICATION5_FW_REGION:
-			start_address = USER_APPLICATION5_START_ADDRESS;
-			break;
-		default:
-			break;
+			std::lock_guard<std::mutex> guard(lock);
+			mismatches.insert(mismatches.end(), bad.begin(), bad.end());
+			sectors[current] = -1;
+			current = (current + 1) % BUFFERS;
+			changed.notify_all();
 		}
+	}
+};
 
-		break;
+void V2495_flash::report_bad_pages(uint32_t start_address, const std::vector<int>& bad_pages) {
+	const size_t MAX_LISTED = 16;
 
-	default:
-		throw cuhRetCode_InvalidController;
-		break;
+	for (size_t i = 0; i < bad_pages.size() && i < MAX_LISTED; i++)
+		message(stderr, "Page 0x%X (sector %i) doesn't match the image.\n",
+		        start_address + bad_pages[i], bad_pages[i] / SECTOR_SIZE);
+	if (bad_pages.size() > MAX_LISTED)
+		message(stderr, "... %i more pages don't match.\n", (int)(bad_pages.size() - MAX_LISTED));
+	message(stderr, "Verify failed: %i pages differ.\n", (int)bad_pages.size());
+}
+
+void V2495_flash::check_sectors(uint32_t start_address, const std::vector<int>& sectors, std::vector<int>& bad_pages) {
+	sector_comparer comparer(bitstream, bitstream_length, SECTOR_SIZE, PAGE_SIZE);
+
+	for (size_t i = 0; i < sectors.size(); ++i) {
+		read_sector(start_address + sectors[i] * SECTOR_SIZE, comparer.get_buffer());
+		comparer.submit(sectors[i]);
 	}
 
-	// Se si deve aggiornare l'iimagine di boot bisogna
-	// sproteggere i settori dedicati al firmware FACTORY (BOOT)
-	if (region == BOOT_FW_REGION)
-		write_unprotect();
+	comparer.finish(bad_pages);
+}
 
+void V2495_flash::erase_sectors(uint32_t start_address, const std::vector<int>& sectors) {
 	// Cancella i settori a partire da quello pi� basso,
 	// in modo da lasciare "corrotta" la flash in caso di interruzione prematura
 	// della cancellazione.
-	if (!skip_erase)
-		// Erase sectors
-		for (int i = 0; i < sectors_to_write; ++i) {
-			sector_erase(start_address + i * SECTOR_SIZE);
-                        printf("Erasing sector %i.\n",i);
-		}
+	STATS_PHASE(PHASE_ERASE);
+	for (size_t i = 0; i < sectors.size(); ++i) {
+		sector_erase(start_address + sectors[i] * SECTOR_SIZE);
+		message(stdout, "Erasing sector %i.\n", sectors[i]);
+		journal_record('E', sectors[i]);
+	}
+}
+
+void V2495_flash::program_sectors(uint32_t start_address, const std::vector<int>& sectors, int verify, std::vector<int>& bad_pages) {
+	// Pages to program in the current sector
+	std::vector<page_plan_t> pages;
+	// With verify, each sector is read back once programmed and compared
+	// by a worker thread while the next one is programmed
+	std::unique_ptr<sector_comparer> comparer;
+
+	bad_pages.clear();
+	if (verify)
+		comparer.reset(new sector_comparer(bitstream, bitstream_length, SECTOR_SIZE, PAGE_SIZE));
 
 	// Programma le pagine di ciascun settore
 	// Programma i settori a partire da quello pi� alto
 	// in modo da lasciare "corrotta" la flash in caso di interruzione prematura
 	// della programmazione.
-	for (int sector = sectors_to_write - 1; sector >= 0; --sector){
-                printf("Writing sector %i.\n",sector);
-		for (int page = SECTOR_SIZE / PAGE_SIZE - 1; page >= 0; --page) {
-			int offset = sector * SECTOR_SIZE + page * PAGE_SIZE;
+	for (int i = (int)sectors.size() - 1; i >= 0; --i) {
+		int sector = sectors[i];
+
+		message(stdout, "Writing sector %i.\n", sector);
+		plan_sector_pages(sector, pages);
+
+		// Pages are written straight from the (read only) bitstream
+		STATS_PHASE(PHASE_PROGRAM);
+		for (size_t page = 0; page < pages.size(); ++page)
+			write_page(start_address + pages[page].offset, bitstream + pages[page].offset, pages[page].length);
+		journal_record('P', sector);
+
+		if (verify) {
+			STATS_PHASE(PHASE_VERIFY);
+			read_sector(start_address + sector * SECTOR_SIZE, comparer->get_buffer());
+			comparer->submit(sector);
+		}
+	}
+
+	if (verify)
+		comparer->finish(bad_pages);
+}
+
+void V2495_flash::program_firmware(fw_region_t region, char *filename, int verify, int no_bit_reverse, int skip_erase) {
+
+	int sectors_to_write;
+	uint32_t start_address;
+	
+	STATS_PHASE(PHASE_LOAD);
+	load_bitstream_from_file(filename, no_bit_reverse);
+
+	get_region(region, &start_address, &sectors_to_write);
+	sectors_to_write = image_sectors(sectors_to_write);
+
+	// Sectors to erase and to program, in ascending order
+	std::vector<int> to_erase;
+	std::vector<int> to_program;
+	std::vector<int> bad_pages;
+
+	STATS_PHASE(PHASE_VERIFY);
+	plan_run(region, start_address, sectors_to_write, to_erase, to_program);
+	STATS_PHASE(PHASE_OTHER);
+	if (to_erase.empty() && to_program.empty()) {
+		// Nothing left (e.g. a journal of a completed run): don't keep it
+		if (journal != NULL)
+			journal->remove();
+		shadow_record(region);
+		return;
+	}
+
+	shadow_forget(region);
+
+	// Se si deve aggiornare l'iimagine di boot bisogna
+	// sproteggere i settori dedicati al firmware FACTORY (BOOT)
+	STATS_PHASE(PHASE_UNPROTECT);
+	if (region == BOOT_FW_REGION)
+		write_unprotect();
+
+	if (!skip_erase)
+		erase_sectors(start_address, to_erase);
 
-			uint32_t remain = (bitstream_length - offset) > 0 ? bitstream_length - offset : 0;
+	program_sectors(start_address, to_program, verify, bad_pages);
+	if (!bad_pages.empty()) {
+		report_bad_pages(start_address, bad_pages);
+		journal_rewind(bad_pages);
+		throw cuhRetCode_InvalidFirmware;
+	}
 
-			if (remain == 0)
-				continue;
+	// Nel caso di programmazione del boot
+	// al termine si proteggono nuovamente i suoi settori
+	STATS_PHASE(PHASE_PROTECT);
+	if (region == BOOT_FW_REGION && !boot_unprotected)
+		write_protect();
 
-			bytes_to_write = (remain < PAGE_SIZE) ? remain : PAGE_SIZE;
+	STATS_PHASE(PHASE_OTHER);
 
-			memset(buf, 0, PAGE_SIZE);
+	// Without erase the result depends on what the flash held before
+	if (!skip_erase || verify)
+		shadow_record(region);
 
-			// Get next data chunk in bitstream buffer
-			memcpy(buf, bitstream + offset, bytes_to_write);
+	if (journal != NULL)
+		journal->remove();
+}
+
+void V2495_flash::program_firmware_slots(const std::vector<fw_region_t>& regions, char *filename, int verify, int no_bit_reverse) {
+	std::vector<uint32_t> start_addresses(regions.size());
+	std::vector<std::vector<int> > sectors(regions.size());
+	std::vector<int> bad_pages;
+	int failed = 0;
+
+	// One load (and bit reversal) for all the slots
+	STATS_PHASE(PHASE_LOAD);
+	load_bitstream_from_file(filename, no_bit_reverse);
+
+	for (size_t slot = 0; slot < regions.size(); ++slot) {
+		int sectors_to_write;
+
+		if (regions[slot] == BOOT_FW_REGION)
+			throw cuhRetCode_InvalidRegion;
+
+		get_region(regions[slot], &start_addresses[slot], &sectors_to_write);
+		sectors_to_write = image_sectors(sectors_to_write);
+
+		STATS_PHASE(PHASE_VERIFY);
+		select_sectors(start_addresses[slot], sectors_to_write, sectors[slot]);
+	}
 
-			if (!no_bit_reverse) {
-				// Bit reversal
-				for (int k = 0; k < bytes_to_write; ++k)
-					buf[k] = rev_byte(buf[k]);
+	// The journal follows a single region: keep it out of the way
+	V2495_journal *region_journal = journal;
+	journal = NULL;
+
+	try {
+		for (size_t slot = 0; slot < regions.size(); ++slot)
+			shadow_forget(regions[slot]);
+
+		// All the slots are erased first, then programmed and verified one by one
+		for (size_t slot = 0; slot < regions.size(); ++slot) {
+			if (!sectors[slot].empty())
+				message(stdout, "Erasing %s.\n", region_name(regions[slot]));
+			erase_sectors(start_addresses[slot], sectors[slot]);
+		}
+
+		for (size_t slot = 0; slot < regions.size(); ++slot) {
+			if (!sectors[slot].empty())
+				message(stdout, "Programming %s.\n", region_name(regions[slot]));
+			program_sectors(start_addresses[slot], sectors[slot], verify, bad_pages);
+			if (!bad_pages.empty()) {
+				report_bad_pages(start_addresses[slot], bad_pages);
+				failed = 1;
 			}
+			else
+				shadow_record(regions[slot]);
+		}
+	}
+	catch (cuhRetCode_t err) {
+		journal = region_journal;
+		throw;
+	}
+	journal = region_journal;
+
+	STATS_PHASE(PHASE_OTHER);
+
+	if (failed)
+		throw cuhRetCode_InvalidFirmware;
+}
+
+
+void V2495_flash::plan_sector_pages(int sector, std::vector<page_plan_t>& pages) {
+	int pages_per_sector = SECTOR_SIZE / PAGE_SIZE;
+
+	pages.clear();
+
+	for (int page = pages_per_sector - 1; page >= 0; --page) {
+		int offset = sector * SECTOR_SIZE + page * PAGE_SIZE;
+		int remain = bitstream_length - offset;
+		page_plan_t p;
+
+		if (remain <= 0)
+			continue;
+
+		p.offset = offset;
+		p.length = (remain < (int)PAGE_SIZE) ? remain : PAGE_SIZE;
 
-			// Write buffer into flash page
-			write_page(start_address + offset, buf);
+		// The buffer holds the bitstream already bit reversed (once, at
+		// load). 0xFF is its own reversal, so a page of 0xFF here is blank
+		// in the file too: the erase already left it that way.
+		if (is_blank(bitstream + offset, p.length))
+			continue;
 
-			if (verify) {
-				read_page(start_address + offset, buf_ver);
-				for (int ii = 0; ii < bytes_to_write; ii++) {
-					if (buf_ver[ii] != buf[ii])
-						throw cuhRetCode_InvalidFirmware;
+		pages.push_back(p);
+	}
+}
+
+void V2495_flash::set_transfer_mode(transfer_mode_t mode) {
+	transfer_mode = mode;
+}
+
+void V2495_flash::set_command_batching(int enable) {
+	batch_commands = enable;
+}
+
+void V2495_flash::set_differential_mode(int enable) {
+	differential_mode = enable;
+}
+
+void V2495_flash::select_sectors(uint32_t start_address, int sectors_to_write, std::vector<int>& sectors) {
+	if (differential_mode) {
+		find_changed_sectors(start_address, sectors_to_write, sectors);
+		if (sectors.empty())
+			message(stdout, "Firmware already up to date, nothing to program.\n");
+		else
+			message(stdout, "%i of %i sectors differ.\n", (int)sectors.size(), sectors_to_write);
+	}
+	else {
+		sectors.clear();
+		for (int i = 0; i < sectors_to_write; ++i)
+			sectors.push_back(i);
+	}
+}
+
+void V2495_flash::plan_run(fw_region_t region, uint32_t start_address, int sectors_to_write,
+                           std::vector<int>& to_erase, std::vector<int>& to_program) {
+	std::vector<int> planned;
+	std::vector<int> erased;
+	std::vector<int> programmed;
+	char key[256];
+
+	to_erase.clear();
+	to_program.clear();
+
+	if (journal != NULL) {
+		snprintf(key, sizeof(key), "%s controller=0x%X region=%d length=%d hash=%016llx", journal_key,
+		         controller_base_address, (int)region, bitstream_length,
+		         (unsigned long long)V2495_journal::hash(bitstream, bitstream_length));
+
+		if (journal_resume && journal->load(key, planned, erased, programmed)) {
+			std::vector<uint8_t> buf(SECTOR_SIZE);
+			int next = -1;
+
+			message(stdout, "Resuming from %s: %i of %i sectors erased, %i programmed.\n", journal->get_path(),
+			        (int)erased.size(), (int)planned.size(), (int)programmed.size());
+
+			// The last sector recorded as programmed is checked: if it
+			// doesn't match the image it is erased and programmed again.
+			if (!programmed.empty() && !sector_matches(start_address, programmed.back(), &buf[0])) {
+				message(stdout, "Sector %i doesn't match, rewriting it.\n", programmed.back());
+				programmed.pop_back();
+			}
+
+			// Once all the sectors are erased, the highest one not programmed
+			// may have been interrupted while programming: erase it again.
+			if (erased.size() >= planned.size()) {
+				for (int i = (int)planned.size() - 1; i >= 0 && next < 0; --i) {
+					if (std::find(programmed.begin(), programmed.end(), planned[i]) == programmed.end())
+						next = planned[i];
 				}
 			}
+
+			journal->start(key, planned);
+			for (size_t i = 0; i < planned.size(); ++i) {
+				int sector = planned[i];
+
+				if (sector == next || std::find(erased.begin(), erased.end(), sector) == erased.end())
+					to_erase.push_back(sector);
+				else
+					journal->record('E', sector);
+			}
+			for (size_t i = 0; i < planned.size(); ++i) {
+				int sector = planned[i];
+
+				if (std::find(programmed.begin(), programmed.end(), sector) == programmed.end())
+					to_program.push_back(sector);
+			}
+			for (size_t i = 0; i < programmed.size(); ++i)
+				journal->record('P', programmed[i]);
+			return;
 		}
 	}
 
-	// Nel caso di programmazione del boot
-	// al termine si proteggono nuovamente i suoi settori
-	if (region == BOOT_FW_REGION)
-		write_protect();
+	select_sectors(start_address, sectors_to_write, planned);
+
+	if (journal != NULL) {
+		if (planned.empty())
+			journal->remove();
+		else
+			journal->start(key, planned);
+	}
 
+	to_erase = planned;
+	to_program = planned;
 }
 
+void V2495_flash::journal_record(char operation, int sector) {
+	if (journal != NULL)
+		journal->record(operation, sector);
+}
 
-void V2495_flash::verify_firmware(fw_region_t region, char *filename, int no_bit_reverse) {
+void V2495_flash::journal_rewind(const std::vector<int>& bad_pages) {
+	int last = -1;
 
-	load_bitstream_from_file(filename);
+	// bad_pages is sorted: one record per sector
+	for (size_t i = 0; i < bad_pages.size(); ++i) {
+		int sector = bad_pages[i] / SECTOR_SIZE;
 
-	uint8_t * buf;
-	uint8_t * buf_ver;
-	buf = new uint8_t[PAGE_SIZE];
-	buf_ver = new uint8_t[PAGE_SIZE];
+		if (sector != last)
+			journal_record('X', sector);
+		last = sector;
+	}
+}
 
-	int sectors_to_read;
-	int bytes_to_read;
+void V2495_flash::set_journal(const char *path, const char *key, int resume) {
+	if (journal != NULL) {
+		delete journal;
+		journal = NULL;
+	}
+
+	if (path == NULL)
+		return;
+
+	journal = new V2495_journal(path);
+	journal_resume = resume;
+	snprintf(journal_key, sizeof(journal_key), "%s", key);
+}
+
+void V2495_flash::set_shadow(const char *path, const char *board) {
+	if (shadow != NULL) {
+		delete shadow;
+		shadow = NULL;
+	}
+
+	if (path == NULL)
+		return;
+
+	shadow = new V2495_shadow(path, board);
+}
+
+void V2495_flash::shadow_key(fw_region_t region, char *key, size_t size) {
+	snprintf(key, size, "%s %s", (controller_base_address == USER_CONTROLLER_OFFSET) ? "user" : "main", region_name(region));
+}
+
+void V2495_flash::shadow_record(fw_region_t region) {
+	std::vector<uint64_t> sectors;
+	char key[32];
+
+	if (shadow == NULL)
+		return;
 
+	shadow_key(region, key, sizeof(key));
+	V2495_shadow::hash_sectors(bitstream, bitstream_length, SECTOR_SIZE, sectors);
+	shadow->store(key, bitstream_length, sectors);
+}
+
+void V2495_flash::shadow_forget(fw_region_t region) {
+	char key[32];
+
+	if (shadow == NULL)
+		return;
+
+	shadow_key(region, key, sizeof(key));
+	shadow->forget(key);
+}
+
+void V2495_flash::shadow_erased(fw_region_t region) {
+	char key[32];
+
+	if (shadow == NULL)
+		return;
+
+	shadow_key(region, key, sizeof(key));
+	shadow->store(key, 0, std::vector<uint64_t>());
+}
+
+V2495_flash::quick_check_t V2495_flash::quick_check(fw_region_t region, char *filename, int sample_pages, int no_bit_reverse) {
+	std::vector<uint64_t> recorded;
+	std::vector<uint64_t> image;
 	uint32_t start_address;
+	uint32_t length;
+	int region_sectors;
+	int pages;
+	int changed = 0;
+	uint32_t mismatch;
+	char key[32];
+
+	get_region(region, &start_address, &region_sectors);
+
+	STATS_PHASE(PHASE_LOAD);
+	load_bitstream_from_file(filename, no_bit_reverse);
+	image_sectors(region_sectors);
+	STATS_PHASE(PHASE_OTHER);
+
+	shadow_key(region, key, sizeof(key));
+	if (shadow == NULL || !shadow->load(key, &length, recorded)) {
+		message(stdout, "No shadow of %s.\n", region_name(region));
+		return QUICK_CHECK_UNKNOWN;
+	}
 
-	switch (controller_base_address) {
-	case MAIN_CONTROLLER_OFFSET:
-		sectors_to_read = MAIN_FIRMWARE_SECTORS;
+	V2495_shadow::hash_sectors(bitstream, bitstream_length, SECTOR_SIZE, image);
+	for (size_t i = 0; i < image.size(); i++) {
+		if (i >= recorded.size() || recorded[i] != image[i])
+			changed++;
+	}
+	if (changed > 0 || length != (uint32_t)bitstream_length) {
+		message(stdout, "%s differs from the image: %d sectors changed.\n", region_name(region), changed);
+		return QUICK_CHECK_OUTDATED;
+	}
 
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = MAIN_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = MAIN_APPLICATION_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION3_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION4_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION5_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		default:
-			throw cuhRetCode_InvalidRegion;
-			break;
+	// The shadow doesn't see what other tools (or another host) wrote:
+	// a few pages read back confirm the flash still holds the image
+	if (!sample_matches(start_address, sample_pages, &mismatch)) {
+		message(stdout, "%s differs from its shadow at 0x%08X.\n", region_name(region), mismatch);
+		shadow->forget(key);
+		return QUICK_CHECK_OUTDATED;
+	}
+
+	pages = (bitstream_length + PAGE_SIZE - 1) / PAGE_SIZE;
+	message(stdout, "%s is up to date (%d pages read back).\n", region_name(region), (sample_pages < pages) ? sample_pages : pages);
+	return QUICK_CHECK_UP_TO_DATE;
+}
+
+int V2495_flash::spot_check(fw_region_t region, char *filename, int sample_pages, int no_bit_reverse) {
+	uint32_t start_address;
+	uint32_t mismatch;
+	int region_sectors;
+
+	get_region(region, &start_address, &region_sectors);
+
+	STATS_PHASE(PHASE_LOAD);
+	load_bitstream_from_file(filename, no_bit_reverse);
+	image_sectors(region_sectors);
+	STATS_PHASE(PHASE_OTHER);
+
+	if (!sample_matches(start_address, sample_pages, &mismatch)) {
+		message(stdout, "%s differs from %s at 0x%08X.\n", region_name(region), filename, mismatch);
+		return 0;
+	}
+	return 1;
+}
+
+int V2495_flash::sample_matches(uint32_t start_address, int sample_pages, uint32_t *mismatch) {
+	int pages = (bitstream_length + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint8_t buf[PAGE_SIZE];
+	std::mt19937 rng(std::random_device{}());
+
+	STATS_PHASE(PHASE_VERIFY);
+	for (int i = 0; i < sample_pages && i < pages; i++) {
+		int page = (i == 0) ? 0 : (int)(rng() % pages);
+		uint32_t offset = page * PAGE_SIZE;
+		uint32_t bytes = (bitstream_length - offset < PAGE_SIZE) ? bitstream_length - offset : PAGE_SIZE;
+
+		read_page(start_address + offset, buf);
+		if (memcmp(buf, bitstream + offset, bytes) != 0) {
+			STATS_PHASE(PHASE_OTHER);
+			*mismatch = start_address + offset;
+			return 0;
 		}
+	}
+	STATS_PHASE(PHASE_OTHER);
+	return 1;
+}
 
-		break;
-	case USER_CONTROLLER_OFFSET:
-		sectors_to_read = USER_FIRMWARE_SECTORS;
+int V2495_flash::sector_matches(uint32_t start_address, int sector, uint8_t *buf) {
+	int offset = sector * SECTOR_SIZE;
+	int bytes_to_check = bitstream_length - offset;
 
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = USER_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = USER_APPLICATION1_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			start_address = USER_APPLICATION2_START_ADDRESS;
-			break;
-		case APPLICATION3_FW_REGION:
-			start_address = USER_APPLICATION3_START_ADDRESS;
-			break;
-		case APPLICATION4_FW_REGION:
-			start_address = USER_APPLICATION4_START_ADDRESS;
-			break;
-		case APPLICATION5_FW_REGION:
-			start_address = USER_APPLICATION5_START_ADDRESS;
+	if (bytes_to_check <= 0)
+		return 1;
+	if (bytes_to_check > (int)SECTOR_SIZE)
+		bytes_to_check = SECTOR_SIZE;
+
+	read_sector(start_address + offset, buf);
+
+	return memcmp(buf, bitstream + offset, bytes_to_check) == 0;
+}
+
+void V2495_flash::find_changed_sectors(uint32_t start_address, int sectors, std::vector<int>& changed) {
+	std::vector<int> to_check;
+	std::vector<int> bad_pages;
+
+	changed.clear();
+
+	for (int sector = 0; sector < sectors; ++sector) {
+		if (bitstream_length - sector * (int)SECTOR_SIZE <= 0)
 			break;
-		default:
+		to_check.push_back(sector);
+	}
+
+	message(stdout, "Checking %i sectors.\n", (int)to_check.size());
+	check_sectors(start_address, to_check, bad_pages);
+
+	// bad_pages is sorted: one entry per sector, with its number of pages
+	for (size_t i = 0; i < bad_pages.size(); ) {
+		int sector = bad_pages[i] / SECTOR_SIZE;
+		size_t pages = 0;
+
+		while (i < bad_pages.size() && bad_pages[i] / (int)SECTOR_SIZE == sector) {
+			pages++;
+			i++;
+		}
+		message(stdout, "Sector %i: %i pages differ.\n", sector, (int)pages);
+		changed.push_back(sector);
+	}
+
+	// The first sector is always erased first and programmed last, so that
+	// an interruption leaves an invalid image behind. Keep it in the list
+	// whenever any other sector has to be rewritten.
+	if (!changed.empty() && changed[0] != 0)
+		changed.insert(changed.begin(), 0);
+}
+
+
+void V2495_flash::job_prepare(fw_region_t region, char *filename, int no_bit_reverse) {
+	int sectors_to_write;
+	uint32_t start_address;
+	std::vector<int> to_erase;
+	std::vector<int> to_program;
+	std::vector<page_plan_t> pages;
+	job_step_t step;
+
+	STATS_PHASE(PHASE_LOAD);
+	load_bitstream_from_file(filename, no_bit_reverse);
+
+	get_region(region, &start_address, &sectors_to_write);
+	sectors_to_write = image_sectors(sectors_to_write);
+
+	STATS_PHASE(PHASE_VERIFY);
+	plan_run(region, start_address, sectors_to_write, to_erase, to_program);
+	STATS_PHASE(PHASE_OTHER);
+
+	job_region = region;
+	job_start_address = start_address;
+	job_programmed = to_program;
+	job_steps.clear();
+	job_next = 0;
+	job_busy = 0;
+
+	if (to_erase.empty() && to_program.empty())
+		return;
+
+	shadow_forget(region);
+
+	// Same order as program_firmware: erase from the lowest
+	// sector, program from the highest one.
+	for (size_t i = 0; i < to_erase.size(); ++i) {
+		step.op = FLASH_OP_SECTOR_ERASE;
+		step.sector = to_erase[i];
+		step.address = start_address + to_erase[i] * SECTOR_SIZE;
+		step.offset = 0;
+		step.length = 0;
+		job_steps.push_back(step);
+	}
+
+	for (int i = (int)to_program.size() - 1; i >= 0; --i) {
+		plan_sector_pages(to_program[i], pages);
+		for (size_t page = 0; page < pages.size(); ++page) {
+			step.op = FLASH_OP_PAGE_PROGRAM;
+			step.sector = to_program[i];
+			step.address = start_address + pages[page].offset;
+			step.offset = pages[page].offset;
+			step.length = pages[page].length;
+			job_steps.push_back(step);
+		}
+	}
+
+	STATS_PHASE(PHASE_UNPROTECT);
+	if (job_region == BOOT_FW_REGION)
+		write_unprotect();
+	STATS_PHASE(PHASE_OTHER);
+}
+
+int V2495_flash::job_step() {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	if (job_busy) {
+		const job_step_t& current = job_steps[job_next - 1];
+		flash_timing_t *timing = &flash_timing[current.op];
+		uint32_t elapsed_us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - job_step_start).count();
+
+		// Don't spend link time polling before the operation can be over
+		if (elapsed_us < job_poll_at_us)
+			return 1;
+
+		job_polls++;
+		STATS_SET_PHASE(step_phase(current.op));
+		STATS_POLLS(OP_WAIT_FLASH, 1);
+		if (!flash_ready()) {
+			if (elapsed_us > timing->timeout_us) {
+				message(stderr, "Flash still busy after %u ms.\n", timing->timeout_us / 1000);
+				throw cuhRetCode_Timeout;
+			}
+			// Same backoff as wait_flash
+			job_last_busy_us = elapsed_us;
+			job_poll_at_us = elapsed_us + job_backoff_us;
+			if (job_backoff_us < timing->expected_us / 4)
+				job_backoff_us *= 2;
+			return 1;
+		}
+		learn_timing(current.op, job_polls, job_last_busy_us, elapsed_us);
+		job_busy = 0;
+		job_step_done();
+	}
+
+	if (job_next == job_steps.size())
+		return 0;
+
+	const job_step_t& step = job_steps[job_next];
+
+	if (job_next == 0 || job_steps[job_next - 1].op != step.op || job_steps[job_next - 1].sector != step.sector)
+		message(stdout, "%s sector %i.\n", (step.op == FLASH_OP_SECTOR_ERASE) ? "Erasing" : "Writing", step.sector);
+
+	STATS_SET_PHASE(step_phase(step.op));
+	for (int attempt = 0; ; attempt++) {
+		try {
+			if (step.op == FLASH_OP_SECTOR_ERASE)
+				start_sector_erase(step.address);
+			else
+				start_write_page(step.address, bitstream + step.offset, step.length);
 			break;
 		}
+		catch (cuhRetCode_t err) {
+			if (err != cuhRetCode_Comm || !retry_wait(attempt, (step.op == FLASH_OP_SECTOR_ERASE) ? "Sector erase" : "Page program", err))
+				throw;
+		}
 
-		break;
+		// Same recovery as sector_erase and write_page
+		if (step.op == FLASH_OP_SECTOR_ERASE)
+			recover_controller(step.op);
+		else if (page_programmed(step.address, bitstream + step.offset, step.length)) {
+			job_next++;
+			job_step_done();
+			return 1;
+		}
+	}
+
+	job_step_start = std::chrono::steady_clock::now();
+	job_poll_at_us = flash_timing[step.op].expected_us * 3 / 4;
+	job_backoff_us = POLL_MIN_BACKOFF_US;
+	job_polls = 0;
+	job_last_busy_us = 0;
+	job_busy = 1;
+	job_next++;
+	return 1;
+}
+
+void V2495_flash::job_step_done() {
+	const job_step_t& done = job_steps[job_next - 1];
+
+	// Erase done, or last page of a sector done
+	if (done.op == FLASH_OP_SECTOR_ERASE)
+		journal_record('E', done.sector);
+	else if (job_next == job_steps.size() || job_steps[job_next].sector != done.sector)
+		journal_record('P', done.sector);
+}
+
+uint32_t V2495_flash::job_wait_us() {
+	uint32_t elapsed_us;
+
+	if (!job_busy)
+		return 0;
+
+	elapsed_us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job_step_start).count();
+
+	if (elapsed_us >= job_poll_at_us)
+		return 0;
+	return job_poll_at_us - elapsed_us;
+}
+
+void V2495_flash::job_finish() {
+	// Nel caso di programmazione del boot
+	// al termine si proteggono nuovamente i suoi settori
+	STATS_PHASE(PHASE_PROTECT);
+	if (job_region == BOOT_FW_REGION && !job_steps.empty() && !boot_unprotected)
+		write_protect();
+	STATS_PHASE(PHASE_OTHER);
+
+	if (journal != NULL && !job_steps.empty())
+		journal->remove();
+
+	shadow_record(job_region);
+
+	job_steps.clear();
+}
+
+int V2495_flash::job_verify() {
+	std::vector<int> bad_pages;
+
+	STATS_PHASE(PHASE_VERIFY);
+	check_sectors(job_start_address, job_programmed, bad_pages);
+	STATS_PHASE(PHASE_OTHER);
+
+	if (bad_pages.empty())
+		return 1;
+	report_bad_pages(job_start_address, bad_pages);
+	journal_rewind(bad_pages);
+	return 0;
+}
+
+void V2495_flash::job_abort() {
+	// Errors here would hide the one that stopped the job
+	try {
+		if (job_region == BOOT_FW_REGION && !job_steps.empty() && !boot_unprotected)
+			write_protect();
+	}
+	catch (cuhRetCode_t err) {
+		message(stderr, "Error %d protecting the boot sectors.\n", err);
+	}
+	job_steps.clear();
+}
+
+void V2495_flash::program_firmware_interleaved(V2495_flash& first, fw_region_t first_region, char *first_filename,
+                                               V2495_flash& second, fw_region_t second_region, char *second_filename, int verify) {
+	int first_active = 1;
+	int second_active = 1;
+	int first_ok;
+	int second_ok;
+
+	first.job_prepare(first_region, first_filename);
+	try {
+		second.job_prepare(second_region, second_filename);
+	}
+	catch (cuhRetCode_t err) {
+		first.job_abort();
+		throw;
+	}
+
+	try {
+		// Whenever a controller is idle give it the next operation, then
+		// sleep until the first of the two operations in progress may be over.
+		while (first_active || second_active) {
+			uint32_t wait_us = 0xFFFFFFFF;
+
+			if (first_active)
+				first_active = first.job_step();
+			if (second_active)
+				second_active = second.job_step();
+
+			if (first_active && first.job_wait_us() < wait_us)
+				wait_us = first.job_wait_us();
+			if (second_active && second.job_wait_us() < wait_us)
+				wait_us = second.job_wait_us();
+
+			if (first_active || second_active)
+				first.sleep_us(wait_us);
+		}
 
-	default:
-		throw cuhRetCode_InvalidRegion;
-		break;
+		// Read back only what was programmed, one flash after the other
+		first_ok = !verify || first.job_verify();
+		second_ok = !verify || second.job_verify();
+	}
+	catch (cuhRetCode_t err) {
+		first.job_abort();
+		second.job_abort();
+		throw;
 	}
 
+	if (first_ok)
+		first.job_finish();
+	else
+		first.job_abort();
+	if (second_ok)
+		second.job_finish();
+	else
+		second.job_abort();
+
+	if (!first_ok || !second_ok)
+		throw cuhRetCode_InvalidFirmware;
+}
 
-	// Programma le pagine di ciascun settore
-	// Programma i settori a partire da quello pi� alto
-	for (int sector = 0; sector < sectors_to_read; ++sector){
-		for (uint32_t page = 0; page < SECTOR_SIZE / PAGE_SIZE; ++page) {
-			int offset = sector * SECTOR_SIZE + page * PAGE_SIZE;
 
-			uint32_t remain = (bitstream_length - offset) > 0 ? bitstream_length - offset : 0;
+void V2495_flash::repair_firmware(fw_region_t region, char *filename, int no_bit_reverse) {
+	int differential = differential_mode;
+
+	// A repair is a differential programming with verify: the whole region
+	// is checked, only the sectors that differ (and sector 0, to keep the
+	// safe ordering) are erased and programmed again, then read back.
+	differential_mode = 1;
+	try {
+		program_firmware(region, filename, 1, no_bit_reverse);
+	}
+	catch (cuhRetCode_t err) {
+		differential_mode = differential;
+		throw;
+	}
+	differential_mode = differential;
+}
+
+void V2495_flash::verify_firmware(fw_region_t region, char *filename, int no_bit_reverse) {
+
+	STATS_PHASE(PHASE_LOAD);
+	load_bitstream_from_file(filename, no_bit_reverse);
+	STATS_PHASE(PHASE_VERIFY);
 
-			if (remain == 0)
-				continue;
+	int sectors_to_read;
+	uint32_t start_address;
+	std::vector<int> sectors;
+	std::vector<int> bad_pages;
 
-			bytes_to_read = (remain < PAGE_SIZE) ? remain : PAGE_SIZE;
+	get_region(region, &start_address, &sectors_to_read);
+	sectors_to_read = image_sectors(sectors_to_read);
 
-			// Point to next data chunk in bitstream buffer
-			//buf = bitstream + i * 64 * 1024 + j * 256;
-			// Get next data chunk in bitstream buffer
-			memcpy(buf, bitstream + offset, bytes_to_read);
+	for (int sector = 0; sector < sectors_to_read; ++sector)
+		sectors.push_back(sector);
 
+	// All the sectors are checked, and all the pages that differ reported
+	check_sectors(start_address, sectors, bad_pages);
 
-			if (!no_bit_reverse) {
-				// Bit reversal
-				for (int k = 0; k < bytes_to_read; ++k)
-					buf[k] = rev_byte(buf[k]);
-			}
+	STATS_PHASE(PHASE_OTHER);
 
-			read_page(start_address + offset, buf_ver);
-			for (int ii = 0; ii < bytes_to_read; ii++) {
-				if (buf_ver[ii] != buf[ii])
-					throw cuhRetCode_InvalidFirmware;
-			}
-		}
+	if (!bad_pages.empty()) {
+		report_bad_pages(start_address, bad_pages);
+		throw cuhRetCode_InvalidFirmware;
 	}
+
+	// The whole image was read back: the shadow can be trusted from now on
+	shadow_record(region);
 }
 
 void V2495_flash::erase_firmware(fw_region_t region) {
@@ -553,66 +1781,9 @@ void V2495_flash::erase_firmware(fw_region_t region) {
 	int sectors_to_erase;
 	uint32_t start_address;
 
-	switch (controller_base_address) {
-	case MAIN_CONTROLLER_OFFSET:
-		sectors_to_erase = MAIN_FIRMWARE_SECTORS;
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = MAIN_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = MAIN_APPLICATION_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION3_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION4_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION5_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		default:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		}
-		break;
-	case USER_CONTROLLER_OFFSET:
-		sectors_to_erase = USER_FIRMWARE_SECTORS;
-
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = USER_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = USER_APPLICATION1_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			start_address = USER_APPLICATION2_START_ADDRESS;
-			break;
-		case APPLICATION3_FW_REGION:
-			start_address = USER_APPLICATION3_START_ADDRESS;
-			break;
-		case APPLICATION4_FW_REGION:
-			start_address = USER_APPLICATION4_START_ADDRESS;
-			break;
-		case APPLICATION5_FW_REGION:
-			start_address = USER_APPLICATION5_START_ADDRESS;
-			break;
-		default:
-			break;
-		}
-
-		break;
-
-	default:
-		throw cuhRetCode_InvalidRegion;
-		break;
-	}
+	get_region(region, &start_address, &sectors_to_erase);
 
+	shadow_forget(region);
 
 	// Se si deve aggiornare l'iimagine di boot bisogna
 	// sproteggere i settori dedicati al firmware FACTORY (BOOT)
@@ -624,103 +1795,164 @@ void V2495_flash::erase_firmware(fw_region_t region) {
 		sector_erase(start_address + i * SECTOR_SIZE);
 	}
 
+	shadow_erased(region);
+
 	// Nel caso di programmazione del boot
 	// al termine si proteggono nuovamente i suoi settori
-	if (region == BOOT_FW_REGION)
+	if (region == BOOT_FW_REGION && !boot_unprotected)
 		write_protect();
 }
 
-void V2495_flash::dump_firmware(fw_region_t region, char *filename, int no_bit_reverse) {
-
-	// TODO
-/*
+void V2495_flash::dump_firmware(fw_region_t region, char *filename, int no_bit_reverse, uint32_t offset, uint32_t length) {
+	int region_sectors;
 	uint32_t start_address;
-	uint32_t sectors_to_dump;
+	uint32_t region_size;
+	FILE *out;
 
-	switch (controller_base_address) {
-	case MAIN_CONTROLLER_OFFSET:
-		sectors_to_dump = MAIN_FIRMWARE_SECTORS;
+	get_region(region, &start_address, &region_sectors);
+	region_size = region_sectors * SECTOR_SIZE;
 
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = MAIN_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = MAIN_APPLICATION_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION3_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION4_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		case APPLICATION5_FW_REGION:
-			throw cuhRetCode_InvalidRegion;
-			break;
-		default:
-			throw cuhRetCode_InvalidRegion;
-			break;
+	if (offset >= region_size)
+		throw cuhRetCode_InvalidRegion;
+	if (length == 0 || length > region_size - offset)
+		length = region_size - offset;
+
+	out = fopen(filename, "wb");
+	if (out == NULL) {
+		message(stderr, "Error opening file %s\n", filename);
+		throw cuhRetCode_FileOpen;
+	}
+
+	message(stdout, "Dumping %u bytes at offset 0x%X to %s\n", length, offset, filename);
+
+	// Two sector buffers: the reader thread fills one from the flash while
+	// this thread bit-reverses and writes the other one to the file.
+	const int BUFFERS = 2;
+	std::vector<uint8_t> buffers[BUFFERS];
+	int first_sector = offset / SECTOR_SIZE;
+	int last_sector = (offset + length - 1) / SECTOR_SIZE;
+	int filled = 0;   // sectors read from the flash
+	int written = 0;  // sectors written to the file
+	int32_t error = cuhRetCode_Success;
+	std::mutex lock;
+	std::condition_variable changed;
+
+	for (int i = 0; i < BUFFERS; i++)
+		buffers[i].resize(SECTOR_SIZE);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::thread reader([&]() {
+		for (int sector = first_sector; sector <= last_sector; sector++) {
+			int n = sector - first_sector;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard, [&]() { return n - written < BUFFERS || error != cuhRetCode_Success; });
+				if (error != cuhRetCode_Success)
+					return;
+			}
+
+			try {
+				read_sector(start_address + sector * SECTOR_SIZE, &buffers[n % BUFFERS][0]);
+			}
+			catch (cuhRetCode_t err) {
+				std::lock_guard<std::mutex> guard(lock);
+				error = err;
+				changed.notify_all();
+				return;
+			}
+
+			std::lock_guard<std::mutex> guard(lock);
+			filled++;
+			changed.notify_all();
 		}
-		break;
-	case USER_CONTROLLER_OFFSET:
-		sectors_to_dump = USER_FIRMWARE_SECTORS;
-		switch (region) {
-		case BOOT_FW_REGION:
-			start_address = USER_FACTORY_START_ADDRESS;
-			break;
-		case APPLICATION1_FW_REGION:
-			start_address = USER_APPLICATION1_START_ADDRESS;
-			break;
-		case APPLICATION2_FW_REGION:
-			start_address = USER_APPLICATION2_START_ADDRESS;
-			break;
-		case APPLICATION3_FW_REGION:
-			start_address = USER_APPLICATION3_START_ADDRESS;
-			break;
-		case APPLICATION4_FW_REGION:
-			start_address = USER_APPLICATION4_START_ADDRESS;
-			break;
-		case APPLICATION5_FW_REGION:
-			start_address = USER_APPLICATION5_START_ADDRESS;
-			break;
-		default:
+	});
+
+	for (int sector = first_sector; sector <= last_sector; sector++) {
+		int n = sector - first_sector;
+		uint32_t sector_start = sector * SECTOR_SIZE;
+		uint32_t from = (offset > sector_start) ? offset - sector_start : 0;
+		uint32_t to = (offset + length < sector_start + SECTOR_SIZE) ? offset + length - sector_start : SECTOR_SIZE;
+		uint8_t *data = &buffers[n % BUFFERS][0];
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			changed.wait(guard, [&]() { return filled > n || error != cuhRetCode_Success; });
+			if (error != cuhRetCode_Success)
+				break;
+		}
+
+		if (!no_bit_reverse)
+			bit_reverse_buffer(data + from, to - from);
+
+		if (fwrite(data + from, 1, to - from, out) != to - from) {
+			message(stderr, "Error writing file %s\n", filename);
+			std::lock_guard<std::mutex> guard(lock);
+			error = cuhRetCode_Write;
+			changed.notify_all();
 			break;
 		}
-		break;
-	default:
-		throw cuhRetCode_InvalidRegion;
-		break;
-	}*/
+		message(stdout, "Dumped sector %i.\n", sector);
+
+		std::lock_guard<std::mutex> guard(lock);
+		written++;
+		changed.notify_all();
+	}
+
+	reader.join();
+
+	if (fclose(out) != 0 && error == cuhRetCode_Success)
+		error = cuhRetCode_Write;
+	if (error != cuhRetCode_Success)
+		throw (cuhRetCode_t)error;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	message(stdout, "Dumped %u bytes in %.1f s (%.2f MB/s)\n", length, seconds, length / seconds / 1e6);
+}
+
+
+void V2495_flash::begin_boot_update() {
+	write_unprotect();
+	boot_unprotected = 1;
 }
 
+void V2495_flash::end_boot_update() {
+	boot_unprotected = 0;
+	write_protect();
+}
 
 void V2495_flash::write_protect() {
 
 	uint32_t data;
 	uint32_t region;
+	uint32_t status;
+	cmd_batch batch(controller_base_address);
 
 
 	switch (controller_base_address) {
 	case MAIN_CONTROLLER_OFFSET:
 		region = PROTECT_SECTORS_0_63 << 2;
-		WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
-		WriteRegister(controller_base_address + ADDRESS_OFFSET, region);
-		WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_STATUS_OPCODE);
-		wait_flash();
+		// Status register writes are slow: skip it if already protected
+		get_protection_status(status);
+		if ((status << 2) == region)
+			return;
+		batch.add(OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
+		batch.add(ADDRESS_OFFSET, region);
+		batch.add(OPCODE_OFFSET, WRITE_STATUS_OPCODE);
+		submit_status_write(batch);
 		break;
 	case USER_CONTROLLER_OFFSET:
 		region = PROTECT_SECTORS_0_127 << 2;
-		WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
-		WriteRegister(controller_base_address + ADDRESS_OFFSET, region);
-		WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_STATUS_OPCODE);
-		wait_flash();
+		get_protection_status(status);
+		if ((status << 2) == region)
+			return;
+		batch.add(OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
+		batch.add(ADDRESS_OFFSET, region);
+		batch.add(OPCODE_OFFSET, WRITE_STATUS_OPCODE);
+		submit_status_write(batch);
 		break;
 	default:
-		// TODO
-		break;
+		throw cuhRetCode_InvalidController;
 	}
 
 	WriteRegister(controller_base_address + OPCODE_OFFSET, READ_STATUS_OPCODE);
@@ -734,13 +1966,18 @@ void V2495_flash::write_unprotect() {
 
 	uint32_t region;
 	uint32_t data;
+	uint32_t status;
+	cmd_batch batch(controller_base_address);
 
 
 	region = UNPROTECT_ALL << 2;
-	WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
-	WriteRegister(controller_base_address + ADDRESS_OFFSET, region);
-	WriteRegister(controller_base_address + OPCODE_OFFSET, WRITE_STATUS_OPCODE);
-	wait_flash();
+	get_protection_status(status);
+	if ((status << 2) == region)
+		return;
+	batch.add(OPCODE_OFFSET, WRITE_ENABLE_OPCODE);
+	batch.add(ADDRESS_OFFSET, region);
+	batch.add(OPCODE_OFFSET, WRITE_STATUS_OPCODE);
+	submit_status_write(batch);
 
 
 	WriteRegister(controller_base_address + OPCODE_OFFSET, READ_STATUS_OPCODE);
@@ -750,21 +1987,174 @@ void V2495_flash::write_unprotect() {
 		throw cuhRetCode_Write;
 }
 
+void V2495_flash::submit_status_write(cmd_batch& batch) {
+	for (int attempt = 0; ; attempt++) {
+		try {
+			submit(batch);
+			wait_flash(FLASH_OP_STATUS_WRITE);
+			return;
+		}
+		catch (cuhRetCode_t err) {
+			if (err != cuhRetCode_Comm || !retry_wait(attempt, "Status write", err))
+				throw;
+		}
+		// Writing the same status again is harmless
+		recover_controller(FLASH_OP_STATUS_WRITE);
+	}
+}
+
+uint32_t V2495_flash::get_config_rom_address() {
+	if (controller_base_address != MAIN_CONTROLLER_OFFSET)
+		throw cuhRetCode_InvalidController;
+
+	return MAIN_CONFIG_ROM_START_ADDRESS;
+}
+
+uint32_t V2495_flash::get_free_area_address() {
+	if (controller_base_address != USER_CONTROLLER_OFFSET)
+		throw cuhRetCode_InvalidController;
+
+	return USER_FREE_START_ADDRESS;
+}
+
+void V2495_flash::reboot_from_region(fw_region_t region) {
+	uint32_t start_address;
+	int sectors;
+
+	get_region(region, &start_address, &sectors);
+
+	// The FPGA reads its configuration from the flash: give it back
+	release_flash_access();
+
+	message(stdout, "Rebooting the FPGA from %s (0x%08X).\n", region_name(region), start_address);
+	WriteRegister(controller_base_address + REBOOT_ADDRESS_OFFSET, start_address);
+	WriteRegister(controller_base_address + REBOOT_OFFSET, 1);
+}
+
+int V2495_flash::get_boot_region(fw_region_t *region) {
+	uint32_t boot_address;
+
+	ReadRegister(controller_base_address + REBOOT_ADDRESS_OFFSET, &boot_address);
+
+	for (int r = BOOT_FW_REGION; r <= APPLICATION5_FW_REGION; r++) {
+		uint32_t start_address;
+		int sectors;
+
+		try {
+			get_region((fw_region_t)r, &start_address, &sectors);
+		}
+		catch (cuhRetCode_t err) {
+			// Application 2 - 5 exist on the user controller only
+			break;
+		}
+		if (start_address == boot_address) {
+			*region = (fw_region_t)r;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void V2495_flash::set_health_check(uint32_t address, uint32_t mask, uint32_t value) {
+	health_check = 1;
+	health_address = address;
+	health_mask = mask;
+	health_value = value;
+}
+
+int V2495_flash::wait_healthy(uint32_t timeout_ms) {
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	uint32_t data;
+	int down = 0;
+
+	for (;;) {
+		// No retries: the registers may not answer until the FPGA is configured
+		int passed = transport->Read32(health_address, &data) == CAENComm_Success && (data & health_mask) == health_value;
+
+		// Right after the reboot command the old image may still answer:
+		// only a pass after the check has failed once counts
+		if (!passed)
+			down = 1;
+		else if (down)
+			return 1;
+		if (std::chrono::steady_clock::now() >= deadline) {
+			if (!down)
+				message(stderr, "The health check never failed: the FPGA didn't reconfigure.\n");
+			return 0;
+		}
+		sleep(HEALTH_POLL_MS);
+	}
+}
+
+void V2495_flash::reboot_with_rollback(fw_region_t region, uint32_t timeout_ms) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	fw_region_t previous;
+
+	if (!health_check) {
+		message(stderr, "No health check set: can't tell whether %s comes up.\n", region_name(region));
+		throw cuhRetCode_Usage;
+	}
+
+	if (!get_boot_region(&previous))
+		previous = BOOT_FW_REGION;
+
+	reboot_from_region(region);
+	if (wait_healthy(timeout_ms)) {
+		message(stdout, "FPGA running from %s after %.0f ms.\n", region_name(region),
+		        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		return;
+	}
+
+	if (previous == region) {
+		message(stderr, "FPGA not running from %s after %u ms.\n", region_name(region), timeout_ms);
+		throw cuhRetCode_Timeout;
+	}
+
+	message(stderr, "FPGA not running from %s after %u ms, rolling back to %s.\n", region_name(region), timeout_ms, region_name(previous));
+	reboot_from_region(previous);
+	if (!wait_healthy(timeout_ms)) {
+		message(stderr, "FPGA not running from %s either.\n", region_name(previous));
+		throw cuhRetCode_Timeout;
+	}
+	throw cuhRetCode_InvalidFirmware;
+}
+
 void V2495_flash::get_protection_status(uint32_t& status) {
 	uint32_t data;
 
 
 	switch (controller_base_address) {
-	case MAIN_CONTROLLER_OFFSET|USER_CONTROLLER_OFFSET:
+	case MAIN_CONTROLLER_OFFSET:
+	case USER_CONTROLLER_OFFSET:
 		WriteRegister(controller_base_address + OPCODE_OFFSET, READ_STATUS_OPCODE);
 		ReadRegister(controller_base_address + OPCODE_OFFSET, &data);
-		status = data >> 10;
+		status = (data >> 10) & 0x3F;
 		break;
 	default:
 		break;
 	}
 }
 
+void V2495_flash::acquire_flash_access() {
+	if (flash_access)
+		return;
+
+	enable_flash_access();
+
+	// Sblocca accesso al controllore flash
+	WriteRegister(controller_base_address + UNLOCK_OFFSET, 0xABBA5511);
+	flash_access = 1;
+}
+
+void V2495_flash::release_flash_access() {
+	if (!flash_access)
+		return;
+
+	flush();
+	disable_flash_access();
+	flash_access = 0;
+}
+
 void V2495_flash::enable_flash_access() {
 	// Sconfigura FPGA
 	// Evita che la flash sia inaccessibile perch� FPGA User non programmata o pin in conflitto
@@ -784,53 +2174,154 @@ void V2495_flash::disable_flash_access() {
 
 void V2495_flash::WriteRegister(uint32_t address, uint32_t data) {
 	int32_t ret;
-	if ((ret = CAENComm_Write32(handle, address, data)) != CAENComm_Success) {
-		fprintf(stderr, "WriteRegister(0x%X, 0x%X) failed with error %d\n.", address, data, ret);
-		throw cuhRetCode_Comm;
+	STATS_START(start);
+	for (int attempt = 0; (ret = transport->Write32(address, data)) != CAENComm_Success; attempt++) {
+		if (!is_idempotent(address, data) || !retry_wait(attempt, "Write32", ret)) {
+			message(stderr, "WriteRegister(0x%X, 0x%X) failed with error %d\n.", address, data, ret);
+			throw cuhRetCode_Comm;
+		}
 	}
+	STATS_RECORD(OP_WRITE_REGISTER, 1, start);
 }
 
 void V2495_flash::ReadRegister(uint32_t address, uint32_t *data) {
 	int32_t ret;
-	if ((ret = CAENComm_Read32(handle, address, data)) != CAENComm_Success) {
-		fprintf(stderr, "ReadRegister(0x%X) failed with error %d\n.", address, ret);
-		throw cuhRetCode_Comm;
+	STATS_START(start);
+	for (int attempt = 0; (ret = transport->Read32(address, data)) != CAENComm_Success; attempt++) {
+		if (!retry_wait(attempt, "Read32", ret)) {
+			message(stderr, "ReadRegister(0x%X) failed with error %d\n.", address, ret);
+			throw cuhRetCode_Comm;
+		}
 	}
+	STATS_RECORD(OP_READ_REGISTER, 1, start);
+}
+
+// Index of the first failed element of a multiple access, -1 if none
+static int first_error(const CAENComm_ErrorCode *errs, int32_t count) {
+	for (int i = 0; i < count; i++) {
+		if (errs[i] != CAENComm_Success)
+			return i;
+	}
+	return -1;
 }
 
 void V2495_flash::MultiWriteRegister(int32_t count, uint32_t *addresses, uint32_t *datas) {
 	int32_t ret;
+	int failed;
+	int idempotent = 1;
 	CAENComm_ErrorCode errs[count];
-	if ((ret = CAENComm_MultiWrite32(handle, addresses, count, datas, errs)) != CAENComm_Success) {
-		fprintf(stderr, "CAENComm_MultiWrite32() failed with error %d\n.", ret);
+	STATS_START(start);
+
+	// A batch can be sent again only if all its writes can
+	for (int i = 0; i < count; i++)
+		idempotent = idempotent && is_idempotent(addresses[i], datas[i]);
+
+	for (int attempt = 0; ; attempt++) {
+		ret = transport->MultiWrite32(addresses, count, datas, errs);
+		failed = (ret == CAENComm_Success) ? first_error(errs, count) : -1;
+
+		if (ret == CAENComm_Success && failed < 0)
+			break;
+		if (idempotent && retry_wait(attempt, "MultiWrite32", (ret != CAENComm_Success) ? ret : errs[failed]))
+			continue;
+
+		if (ret != CAENComm_Success)
+			message(stderr, "CAENComm_MultiWrite32() failed with error %d\n.", ret);
+		else
+			message(stderr, "Write Register failed during multiwrite. address=0x%X, data=0x%X, err=%d\n.", addresses[failed], datas[failed], errs[failed]);
 		throw cuhRetCode_Comm;
 	}
-	for (int i = 0; i < count; i++) {
-		if (errs[i] != CAENComm_Success) {
-			fprintf(stderr, "Write Register failed during multiwrite. address=0x%X, data=0x%X, err=%d\n.", addresses[i], datas[i], ret);
-			throw cuhRetCode_Comm;
-		}
-	}
+	STATS_RECORD(OP_MULTI_WRITE_REGISTER, count, start);
 }
 
 void V2495_flash::MultiReadRegister(int32_t count, uint32_t *addresses, uint32_t *datas) {
 	int32_t ret;
+	int failed;
 	CAENComm_ErrorCode errs[count];
-	if ((ret = CAENComm_MultiRead32(handle, addresses, count, datas, errs)) != CAENComm_Success) {
-		fprintf(stderr, "CAENComm_MultiRead32() failed with error %d\n.", ret);
+	STATS_START(start);
+
+	for (int attempt = 0; ; attempt++) {
+		ret = transport->MultiRead32(addresses, count, datas, errs);
+		failed = (ret == CAENComm_Success) ? first_error(errs, count) : -1;
+
+		if (ret == CAENComm_Success && failed < 0)
+			break;
+		if (retry_wait(attempt, "MultiRead32", (ret != CAENComm_Success) ? ret : errs[failed]))
+			continue;
+
+		if (ret != CAENComm_Success)
+			message(stderr, "CAENComm_MultiRead32() failed with error %d\n.", ret);
+		else
+			message(stderr, "Read Register failed during multiwrite. address=0x%X, err=%d\n.", addresses[failed], errs[failed]);
 		throw cuhRetCode_Comm;
 	}
-	for (int i = 0; i < count; i++) {
-		if (errs[i] != CAENComm_Success) {
-			fprintf(stderr, "Read Register failed during multiwrite. address=0x%X, err=%d\n.", addresses[i], ret);
-			throw cuhRetCode_Comm;
-		}
+	STATS_RECORD(OP_MULTI_READ_REGISTER, count, start);
+}
+
+void V2495_flash::submit(cmd_batch& batch) {
+	if (batch.count == 0)
+		return;
+
+	if (!batch_commands) {
+		for (int i = 0; i < batch.count; i++)
+			WriteRegister(batch.addrs[i], batch.datas[i]);
+		return;
+	}
+
+	MultiWriteRegister(batch.count, batch.addrs, batch.datas);
+}
+
+int V2495_flash::BlockReadRegister(uint32_t address, int32_t count, uint32_t *datas) {
+	int32_t ret;
+	int32_t nw = 0;
+	STATS_START(start);
+
+	for (int attempt = 0; ; attempt++) {
+		if (transfer_mode == TRANSFER_MBLT)
+			ret = transport->MBLTRead(address, datas, count * sizeof(uint32_t), &nw);
+		else
+			ret = transport->BLTRead(address, datas, count * sizeof(uint32_t), &nw);
+
+		// Links without block transfers fail at once
+		if ((ret == CAENComm_Success && nw == count) || ret == CAENComm_NotSupported ||
+		    !retry_wait(attempt, (transfer_mode == TRANSFER_MBLT) ? "MBLTRead" : "BLTRead", ret))
+			break;
+	}
+
+	if (ret != CAENComm_Success || nw != count) {
+		message(stderr, "%s read of 0x%X failed with error %d (%d words), using MultiRead32.\n",
+			(transfer_mode == TRANSFER_MBLT) ? "MBLT" : "BLT", address, ret, nw);
+		transfer_mode = TRANSFER_MULTIREAD;
+		return 0;
 	}
+	STATS_RECORD(OP_BLOCK_READ_REGISTER, count, start);
+	return 1;
+}
+
+void V2495_flash::set_log_prefix(const char *prefix) {
+	snprintf(log_prefix, sizeof(log_prefix), "%s", prefix);
+}
+
+void V2495_flash::message(FILE *stream, const char *format, ...) {
+	char text[512];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	if (log_stream != NULL)
+		stream = log_stream;
+
+	// One write per line, so that lines of boards programmed
+	// in parallel don't get mixed up
+	fprintf(stream, "%s%s", log_prefix, text);
 }
 
 void V2495_flash::closeDevice() {
-	if (handle != -1)
-		CAENComm_CloseDevice(handle);
+	if (own_transport && transport != NULL)
+		delete transport;
+	transport = NULL;
 }
 
 void V2495_flash::sleep(uint32_t ms) {
@@ -840,3 +2331,13 @@ void V2495_flash::sleep(uint32_t ms) {
 	usleep(ms * 1000);
 #endif
 }
+
+void V2495_flash::sleep_us(uint32_t us) {
+	if (us == 0)
+		return;
+#ifdef WIN32
+	Sleep((us + 999) / 1000);
+#else
+	usleep(us);
+#endif
+}
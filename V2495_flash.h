@@ -1,5 +1,17 @@
 //#pragma once
+#ifndef V2495_FLASH_H
+#define V2495_FLASH_H
+
 #include <stdint.h> // for fixed-width integers
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <time.h>
+#include "V2495_transport.h"
+#include "V2495_stats.h"
+#include "V2495_journal.h"
+#include "V2495_shadow.h"
 
 using namespace std;
 
@@ -7,7 +19,8 @@ class V2495_flash
 {
 
 private:
-	int handle;
+	V2495_transport *transport;
+	int own_transport; // transport opened (and closed) by this object
 	int _flash_controller_present;
 
 	uint32_t controller_base_address; 
@@ -78,65 +91,266 @@ private:
 	const static uint32_t USER_APPLICATION3_START_ADDRESS = 0x01040000;
 	const static uint32_t USER_APPLICATION4_START_ADDRESS = 0x01460000;
 	const static uint32_t USER_APPLICATION5_START_ADDRESS = 0x01880000;
+	const static uint32_t USER_FREE_START_ADDRESS = 0x01CA0000;
 
 	const static uint32_t PAGE_SIZE                      = 256; // bytes
 	const static uint32_t SECTOR_SIZE                    = 64 * 1024; // 64KB
 
+	// Size of the firmware regions. The image loaded from file
+	// can be shorter: only the sectors it occupies are used.
 	const static uint32_t MAIN_FIRMWARE_SECTORS          = 42;
-	const static uint32_t MAIN_FIRMWARE_BITSTREAM_LENGTH = 2709139; // bytes
-
 	const static uint32_t USER_FIRMWARE_SECTORS          = 66;
-	const static uint32_t USER_FIRMWARE_BITSTREAM_LENGTH = 4321299; // bytes
 
 	uint8_t *bitstream;
-	int bitstream_length;
+	int bitstream_length; // length of the file, bytes
+	int bitstream_mapped; // bitstream is a memory mapping of the file (else heap)
+	// File the bitstream was loaded from, to load an unchanged image only once
+	std::string bitstream_file;
+	int bitstream_reversed;
+	time_t bitstream_mtime;
+
+	// Boot sectors left unprotected between begin_boot_update and end_boot_update
+	int boot_unprotected;
+
+	// Health check after a reboot: (register & mask) == value, if health_check is set
+	int health_check;
+	uint32_t health_address;
+	uint32_t health_mask;
+	uint32_t health_value;
+	const static uint32_t HEALTH_POLL_MS = 10;
+
+	// Differential programming: rewrite only the sectors that differ
+	int differential_mode;
+
+	// How the BRAM is read back (see transfer_mode_t)
+	int transfer_mode;
+
+	// Send controller commands as one MultiWrite32 (see cmd_batch)
+	int batch_commands;
+
+	// Ordered list of controller register writes, sent to the board in a
+	// single MultiWrite32 transaction by submit(). Capacity is enough for a
+	// full page program: address, payload, 64 BRAM words and 2 opcodes.
+	class cmd_batch {
+	public:
+		const static int MAX_WRITES = 72;
+
+		int count;
+		uint32_t addrs[MAX_WRITES];
+		uint32_t datas[MAX_WRITES];
+
+		cmd_batch(uint32_t base_address) : count(0), base(base_address) {}
+
+		// Register offsets are relative to the controller base address
+		void add(uint32_t offset, uint32_t data) {
+			addrs[count] = base + offset;
+			datas[count] = data;
+			count++;
+		}
+
+	private:
+		uint32_t base;
+	};
+
+	// Execute a command batch, in order. Unless batching is disabled,
+	// this is a single register transaction.
+	void submit(cmd_batch& batch);
+
+	// A page (or the final part of it) to be programmed
+	typedef struct {
+		int offset;      // offset in the bitstream
+		uint32_t length; // bytes, up to PAGE_SIZE
+	} page_plan_t;
 	
 	// Controller status
 	void get_controller_status(uint32_t * status);
 
 	// Flash status register 
 	void set_flash_status(uint8_t status);
-	void get_flash_status(uint32_t * status);
 
-	// Bit reverse in bytes
-	uint8_t rev_byte(uint8_t x);
+	// Flash operations that set the WIP bit, each one with its own timing
+	typedef enum {FLASH_OP_PAGE_PROGRAM, FLASH_OP_SECTOR_ERASE, FLASH_OP_STATUS_WRITE, FLASH_OP_COUNT} flash_op_t;
+
+	// Poll timing, microseconds. expected_us starts from the datasheet typical
+	// value and then follows the completion times observed on this board.
+	typedef struct {
+		uint32_t expected_us;
+		uint32_t timeout_us;
+	} flash_timing_t;
+
+	flash_timing_t flash_timing[FLASH_OP_COUNT];
 
-	// Wait functions
-	void wait_flash();
+	const static uint32_t CONTROLLER_TIMEOUT_US = 1000000;
+	const static uint32_t POLL_MIN_BACKOFF_US   = 20;
+
+	// Split-phase commands: start the flash operation and return, without
+	// waiting for its end (see flash_ready)
+	void start_sector_erase(uint32_t start_address);
+	void start_write_page(uint32_t start_address, const uint8_t *buf, uint32_t length);
+
+	// Single check (no wait) of the end of the flash operation in progress
+	int flash_ready();
+
+	// Retries after a communication error. Register reads, writes that can
+	// be repeated (see is_idempotent) and whole commands (erase, status
+	// write, page read) are sent again, with a growing delay. A page program
+	// is sent again only if the page read back is blank or partially
+	// programmed with the same data.
+	const static uint32_t RETRY_BACKOFF_US     = 1000;
+	const static uint32_t RETRY_MAX_BACKOFF_US = 100000;
+	int max_retries;
+	int retries; // retries done
+
+	// Returns 0 if attempt was the last one, otherwise waits before the next
+	int retry_wait(int attempt, const char *what, int32_t error);
+	int is_idempotent(uint32_t address, uint32_t data);
+	// Wait for the controller (reset it if it stays busy) and the flash to be idle
+	void recover_controller(flash_op_t op);
+	// After a failed page program: 1 if the page holds the data, 0 if it can be programmed again
+	int page_programmed(uint32_t start_address, const uint8_t *buf, uint32_t length);
+	void read_page_once(uint32_t start_address, uint8_t*  buf);
+	void submit_status_write(cmd_batch& batch);
+
+	// Wait functions. Both throw cuhRetCode_Timeout if the
+	// controller or the flash stay busy for too long.
+	void wait_flash(flash_op_t op);
 	void wait_controller();
 
-	// Bitstream load from file on disk
-	void load_bitstream_from_file(char *filename);
+	// Update the expected time of op, after polls status reads
+	void learn_timing(flash_op_t op, int polls, uint32_t last_busy_us, uint32_t elapsed_us);
+
+	// Bitstream load from file on disk. The file is memory mapped and its
+	// real length is used. Unless no_bit_reverse is set the bitstream is
+	// bit reversed in place, ready to be written to flash. If the same file
+	// is already loaded and didn't change it is not read again.
+	void load_bitstream_from_file(char *filename, int no_bit_reverse);
+	void unload_bitstream();
+
+	// Sectors occupied by the loaded bitstream. Throws cuhRetCode_InvalidFile
+	// if it doesn't fit in a region of region_sectors.
+	int image_sectors(int region_sectors);
+
+	// List the pages of a sector that need programming, from the highest
+	// one down. Pages that are all 0xFF are left out (they are already in
+	// the erased state) and the last page is cut at the end of the bitstream.
+	void plan_sector_pages(int sector, std::vector<page_plan_t>& pages);
+
+	// Sectors (ascending) to erase and program: all of them, or only
+	// those that changed in differential mode
+	void select_sectors(uint32_t start_address, int sectors_to_write, std::vector<int>& sectors);
+
+	// Read back sectors of the region and compare them with the bitstream.
+	// bad_pages gets the bitstream offsets of the pages that differ.
+	void check_sectors(uint32_t start_address, const std::vector<int>& sectors, std::vector<int>& bad_pages);
+	void report_bad_pages(uint32_t start_address, const std::vector<int>& bad_pages);
+
+	// Compare a sector of the region with the bitstream (buf: 64KB work buffer)
+	int sector_matches(uint32_t start_address, int sector, uint8_t *buf);
+	// Compare the first page and sample_pages - 1 random pages of the loaded
+	// bitstream with the flash. Returns 0 at the first mismatch (its
+	// address in *mismatch).
+	int sample_matches(uint32_t start_address, int sample_pages, uint32_t *mismatch);
+
+	// Read back the region and list the sectors (ascending) whose
+	// content differs from the loaded bitstream
+	void find_changed_sectors(uint32_t start_address, int sectors, std::vector<int>& changed);
 
 	// Control flash access from controller
 	void enable_flash_access();
 	void disable_flash_access();
+	int flash_access; // flash access enabled (FPGA deconfigured)
 	
 	void WriteRegister(uint32_t address, uint32_t data);
 	void ReadRegister(uint32_t address, uint32_t *data);
 	
 	void MultiWriteRegister(int32_t count, uint32_t *addresses, uint32_t *datas); // IMPROVE add some 'const'
 	void MultiReadRegister(int32_t count, uint32_t *addresses, uint32_t *datas); // IMPROVE add some 'const'
+
+	// Block read of count consecutive registers with the current transfer mode.
+	// Returns 0 (and switches to TRANSFER_MULTIREAD) if the link can't do it.
+	int BlockReadRegister(uint32_t address, int32_t count, uint32_t *datas);
 	
+	// Prefix printed before every message of this object
+	char log_prefix[64];
+
+	// Stream of all the messages, instead of stdout/stderr (NULL: not set)
+	FILE *log_stream;
+
+	// Sectors changed by write_range and not yet written to the flash.
+	// flash is the content of the flash, data the content to write.
+	typedef struct {
+		uint32_t address;
+		std::vector<uint8_t> flash;
+		std::vector<uint8_t> data;
+		int dirty;
+	} cached_sector_t;
+
+	const static size_t SECTOR_CACHE_SECTORS = 4;
+	std::vector<cached_sector_t> sector_cache;
+
+	// Sector of the cache, read from the flash if it is not there
+	cached_sector_t *cache_sector(uint32_t sector_address);
+	// Write a cached sector: erase only if needed, program the pages that changed
+	void commit_sector(cached_sector_t& sector);
+
+	// Progress journal (NULL: disabled)
+	V2495_journal *journal;
+	int journal_resume;
+	char journal_key[128];
+
+	void journal_record(char operation, int sector);
+	// Record the sectors of bad_pages (bitstream offsets) as not done, so a
+	// resumed run erases and programs them again
+	void journal_rewind(const std::vector<int>& bad_pages);
+
+	// Host side shadow of the regions (NULL: disabled)
+	V2495_shadow *shadow;
+
+	// Register access and wait statistics (built with V2495_STATS only)
+	V2495_stats stats;
+
 	void closeDevice();
 	void sleep(uint32_t ms);
+	void sleep_us(uint32_t us);
 
 
 public:
 	typedef enum {MAIN_CONTROLLER_OFFSET = 0x8500, USER_CONTROLLER_OFFSET = 0x8700} controller_t;
+	typedef enum {TRANSFER_MULTIREAD, TRANSFER_BLT, TRANSFER_MBLT} transfer_mode_t;
 	typedef enum {BOOT_FW_REGION, APPLICATION1_FW_REGION, APPLICATION2_FW_REGION, APPLICATION3_FW_REGION, APPLICATION4_FW_REGION, APPLICATION5_FW_REGION } fw_region_t;
 
+	// Region names: boot, app1 ... app5. parse_region returns 0 if name is unknown.
+	static int parse_region(const char *name, fw_region_t *region);
+	static const char *region_name(fw_region_t region);
+
+	// Open the first USB link (CAENComm_USB, 0, 0, 0)
 	V2495_flash(controller_t controller_offset);
+	// Open the board at target (link type, link number, conet node, VME base address)
+	V2495_flash(controller_t controller_offset, const V2495_target_t& target);
+	// Use an already opened transport (real link or V2495_sim).
+	// The transport is not closed by the destructor.
+	V2495_flash(controller_t controller_offset, V2495_transport *transport);
 	~V2495_flash();
 
 	// Cancella un settore da 64KB
 	// Lo start_address deve essere allineato a 64KB
 	void sector_erase(uint32_t start_address);
+	// Set the 256 bytes page holding start_address to 0xFF (write_range and flush)
 	void page_erase(uint32_t start_address);
 
+	// Write length bytes at any flash address, keeping the rest of the
+	// sectors. The sectors are read into a small cache and written by
+	// flush (or when the cache is full): a sector is erased only if some
+	// bit must go from 0 to 1, and only the pages that changed are
+	// programmed, so several writes to a sector cost one erase at most.
+	void write_range(uint32_t address, const uint8_t *data, uint32_t length);
+	// Write the pending write_range changes to the flash
+	void flush();
+
 	// Scrive una pagina da 256 bytes
 	// Lo start_address deve essere allineatoa 256 bytes
-	void write_page(uint32_t start_address, uint8_t*  buf);
+	// length < 256 programs only the first length bytes of the page
+	void write_page(uint32_t start_address, uint8_t*  buf, uint32_t length = PAGE_SIZE);
 
 	// Legge una pagina di 256 bytes
 	// Lo start_address deve essere allineatoa 256 bytes
@@ -152,15 +366,211 @@ public:
 	// allocated at least to 64K.
 	void write_sector(uint32_t start_address, uint8_t*  buf);
 
+	// Text printed at the beginning of every message (e.g. the board
+	// address, when several boards are programmed at the same time)
+	void set_log_prefix(const char *prefix);
+	// Send all the messages to out instead of stdout/stderr (NULL: back to them)
+	void set_log_stream(FILE *out) { log_stream = out; }
+	// printf-like output to stream (or log_stream), with the log prefix
+	// (also for the classes working on this flash, e.g. V2495_slots)
+	void message(FILE *stream, const char *format, ...);
+
+	// The constructor takes the flash from the FPGA (deconfiguring it) and
+	// the destructor gives it back. A long lived object can give it back
+	// in between, and must take it again before any flash operation.
+	void acquire_flash_access();
+	void release_flash_access();
+	int has_flash_access() { return flash_access; }
+
+	// Select how read_page gets the BRAM content: one MultiRead32 of the
+	// 64 registers or a BLT/MBLT block transfer (default TRANSFER_BLT).
+	// Block transfers fall back to MultiRead32 if the link doesn't support them.
+	void set_transfer_mode(transfer_mode_t mode);
+
+	// Command batching (default on): the register writes of a flash command
+	// (address, payload, BRAM data and opcodes) go out as one MultiWrite32.
+	// When disabled every register is written with its own transaction.
+	void set_command_batching(int enable);
+
+	// When enabled, program_firmware reads back each sector and erases and
+	// rewrites only those that differ from the new bitstream.
+	void set_differential_mode(int enable);
+
+	// Keep a progress journal of program_firmware in the file path, so that an
+	// interrupted programming can be resumed. key identifies the board (the
+	// controller, region and image hash are added to it). With resume set, a
+	// journal left by a run with the same key is continued; otherwise it is
+	// overwritten. The journal is deleted when the programming completes.
+	// path NULL disables the journal.
+	void set_journal(const char *path, const char *key, int resume);
+
+	// Keep the host side shadow of the regions (see V2495_shadow) in the
+	// file path, for the board board (e.g. its serial number, or the target
+	// string when the serial can't be read, as in cvUpgradeV2495). It is updated
+	// by program_firmware, program_firmware_slots, program_firmware_interleaved,
+	// erase_firmware and a successful verify_firmware; lower level writes (write_page, write_range,
+	// sector_erase) are not tracked. path NULL disables the shadow.
+	void set_shadow(const char *path, const char *board);
+
+	typedef enum {QUICK_CHECK_UP_TO_DATE, QUICK_CHECK_OUTDATED, QUICK_CHECK_UNKNOWN} quick_check_t;
+
+	// Tell whether region already holds the image in filename without
+	// reading it back: the sector hashes of the image are compared with the
+	// shadow, then sample_pages pages of the image (the first one and random
+	// others) are read from the flash to confirm it. UNKNOWN if the shadow
+	// has no record of the region (a full verify_firmware is needed).
+	// Nothing is written, but like any flash access it runs with the FPGA
+	// deconfigured (the constructor takes the flash from it).
+	quick_check_t quick_check(fw_region_t region, char *filename, int sample_pages = 16, int no_bit_reverse = 0);
+	// Read back sample_pages pages of the image in filename (the first one
+	// and random others) and compare them with region, without a shadow.
+	// Returns 1 if they all match: a quick confirmation, not a verify.
+	int spot_check(fw_region_t region, char *filename, int sample_pages = 16, int no_bit_reverse = 0);
+
+	// Program two controllers of the same board (main and user flash) at the
+	// same time, over a single link. While one flash is busy erasing or
+	// programming, the next operation is issued to the other one, so the
+	// total time is about the one of the slower flash.
+	// Both objects must share the same transport. With verify the sectors
+	// programmed are read back at the end, from both flashes.
+	static void program_firmware_interleaved(V2495_flash& first, fw_region_t first_region, char *first_filename,
+	                                         V2495_flash& second, fw_region_t second_region, char *second_filename,
+	                                         int verify = 0);
+
 	void program_firmware(fw_region_t region, char *filename, int verify = 0, int no_bit_reverse = 0, int skip_erase = 0); // HACK NOTE : skip_erase e verify potrebbero essere attributi settabili con un set_mode ...
 	void verify_firmware(fw_region_t region, char *filename, int no_bit_reverse = 0);
-	void dump_firmware(fw_region_t region, char *filename, int no_bit_reverse = 0);
+	// Program the same image in several application regions (e.g. user
+	// slots). The image is loaded and bit reversed once, all the regions
+	// are erased and then programmed; with verify each one is read back
+	// and checked against the same image. No journal is kept.
+	void program_firmware_slots(const std::vector<fw_region_t>& regions, char *filename, int verify = 1, int no_bit_reverse = 0);
+	// Check the whole region and rewrite only the damaged sectors, then verify them
+	void repair_firmware(fw_region_t region, char *filename, int no_bit_reverse = 0);
+	// Copy a region (or length bytes of it from offset, length 0 means up to
+	// the end of the region) to a file. Sectors are read from the flash by a
+	// separate thread while the previous one is written to disk.
+	void dump_firmware(fw_region_t region, char *filename, int no_bit_reverse = 0, uint32_t offset = 0, uint32_t length = 0);
 	void erase_firmware(fw_region_t region);
 		
 	void get_protection_status(uint32_t& status);
+	// Flash status register (bit 0: write in progress, upper bits: protection)
+	void get_flash_status(uint32_t * status);
+
+	// Flash address of the configuration ROM sector (main controller only,
+	// see V2495_config_rom)
+	uint32_t get_config_rom_address();
+	// Flash address of the free area after the application regions (user
+	// controller only, sectors 458 - 511)
+	uint32_t get_free_area_address();
+
+	// Configure the FPGA of this controller from the image in region. The
+	// flash is given back to the FPGA first (see release_flash_access).
+	void reboot_from_region(fw_region_t region);
+	// Region the FPGA was last configured from (REBOOT_ADDRESS register, the
+	// boot region after power up). Returns 0 if it is not a region start.
+	int get_boot_region(fw_region_t *region);
+	// Reboot from region and wait up to timeout_ms for the health check to
+	// pass. If it doesn't, the FPGA is configured again from the region it
+	// was running before and cuhRetCode_InvalidFirmware is thrown
+	// (cuhRetCode_Timeout if that one doesn't come up either). Throws
+	// cuhRetCode_Usage, without rebooting, if no health check was set.
+	void reboot_with_rollback(fw_region_t region, uint32_t timeout_ms = 2000);
+	// After a reboot command: poll the health check until it fails (the
+	// FPGA went down) and then passes again (1), or timeout_ms expires (0).
+	// Read errors count as not ready, while the FPGA is configuring.
+	int wait_healthy(uint32_t timeout_ms);
+	// Register read after a reboot (VME address, from the board base) and
+	// the value expected under mask. There is no default: the registers of
+	// the flash controller (e.g. IDCODE) stay up while the FPGA configures,
+	// since the reboot goes through them. It must be a register of the FPGA
+	// design, which doesn't answer (or reads differently) while the FPGA
+	// configures, and whose value tells that the new image is running.
+	void set_health_check(uint32_t address, uint32_t mask, uint32_t value);
 
-	// Sector write protect/unprotect
+	// Retries of a failed transaction or command before giving up (default 5,
+	// 0 disables them), and number of retries done so far
+	void set_retries(int count);
+	int get_retries() { return retries; }
+
+	// Counters and latency histograms of this object, by phase.
+	// They stay at zero unless built with V2495_STATS.
+	V2495_stats& get_stats() { return stats; }
+
+	// Sector write protect/unprotect. The status register is written only
+	// if the protection is not already the requested one.
 	void write_protect();
 	void write_unprotect();
+
+	// Keep the boot sectors unprotected across several operations on the
+	// boot region (they don't protect them again at the end), then protect them
+	void begin_boot_update();
+	void end_boot_update();
+
+private:
+	// Common part of the constructors
+	void init(controller_t controller_offset);
+
+	// Start address and size (sectors) of a firmware region of this controller
+	void get_region(fw_region_t region, uint32_t *start_address, int *sectors);
+
+	// Sectors to erase and to program (ascending) in this run: those of
+	// select_sectors, or what is left of an interrupted run when resuming
+	// from the journal
+	void plan_run(fw_region_t region, uint32_t start_address, int sectors_to_write,
+	              std::vector<int>& to_erase, std::vector<int>& to_program);
+
+	// Erase sectors of a region, from the lowest one
+	void erase_sectors(uint32_t start_address, const std::vector<int>& sectors);
+	// Program sectors of a region with the bitstream, from the highest one.
+	// With verify each sector is read back and checked while the next one
+	// is programmed, bad_pages gets the pages that differ.
+	void program_sectors(uint32_t start_address, const std::vector<int>& sectors, int verify, std::vector<int>& bad_pages);
+
+	// "<main|user> <region>", the key of a region in the shadow
+	void shadow_key(fw_region_t region, char *key, size_t size);
+	// Record the loaded bitstream as the content of region
+	void shadow_record(fw_region_t region);
+	// Region about to change (erased: length 0 and no sectors)
+	void shadow_forget(fw_region_t region);
+	void shadow_erased(fw_region_t region);
+
+	// Split-phase programming job, driven by program_firmware_interleaved
+	typedef struct {
+		flash_op_t op;    // FLASH_OP_SECTOR_ERASE or FLASH_OP_PAGE_PROGRAM
+		int sector;       // sector in the region
+		uint32_t address; // flash address
+		int offset;       // bitstream offset of the page
+		uint32_t length;  // page bytes
+	} job_step_t;
+
+	std::vector<job_step_t> job_steps;
+	size_t job_next;
+	int job_busy;
+	fw_region_t job_region;
+	uint32_t job_start_address;
+	std::vector<int> job_programmed; // sectors programmed, for job_verify
+	std::chrono::steady_clock::time_point job_step_start;
+	uint32_t job_poll_at_us;   // next poll, from job_step_start
+	uint32_t job_backoff_us;
+	uint32_t job_last_busy_us;
+	int job_polls;
+
+	// Load the image and build the list of erase and program steps
+	void job_prepare(fw_region_t region, char *filename, int no_bit_reverse = 0);
+	// Check the step in progress and start the next one when the flash is
+	// idle. Returns 0 when all the steps are done.
+	int job_step();
+	// Journal record of the step just completed
+	void job_step_done();
+	// Time before the step in progress is worth polling
+	uint32_t job_wait_us();
+	// Statistics phase of a step
+	V2495_stats::phase_t step_phase(flash_op_t op) { return (op == FLASH_OP_SECTOR_ERASE) ? V2495_stats::PHASE_ERASE : V2495_stats::PHASE_PROGRAM; }
+	void job_finish();
+	// Read back the sectors programmed. Returns 0 (and reports the pages) if some differ.
+	int job_verify();
+	// Stop the job after an error: protect the boot sectors again
+	void job_abort();
 };
 
+#endif
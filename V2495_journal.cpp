@@ -0,0 +1,142 @@
+#include "V2495_journal.h"
+#include "cvUpgradeV2495.h"
+
+#include <cstring>
+#include <stdlib.h>
+#include <algorithm>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define JOURNAL_MAGIC "V2495 journal 1"
+
+V2495_journal::V2495_journal(const char *path) : path(path), file(NULL)
+{
+}
+
+V2495_journal::~V2495_journal()
+{
+	close();
+}
+
+void V2495_journal::close()
+{
+	if (file != NULL) {
+		fclose(file);
+		file = NULL;
+	}
+}
+
+void V2495_journal::sync()
+{
+	if (fflush(file) != 0)
+		throw cuhRetCode_Write;
+#ifdef WIN32
+	_commit(_fileno(file));
+#else
+	if (fsync(fileno(file)) != 0)
+		throw cuhRetCode_Write;
+#endif
+}
+
+int V2495_journal::load(const char *key, std::vector<int>& planned, std::vector<int>& erased, std::vector<int>& programmed)
+{
+	char line[4096];
+	FILE *in;
+	int valid = 0;
+
+	planned.clear();
+	erased.clear();
+	programmed.clear();
+
+	in = fopen(path.c_str(), "r");
+	if (in == NULL)
+		return 0;
+
+	// Header: magic, key and plan
+	if (fgets(line, sizeof(line), in) == NULL || strncmp(line, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0)
+		goto done;
+	if (fgets(line, sizeof(line), in) == NULL || strncmp(line, "key ", 4) != 0)
+		goto done;
+	line[strcspn(line, "\r\n")] = '\0';
+	if (strcmp(line + 4, key) != 0)
+		goto done;
+	if (fgets(line, sizeof(line), in) == NULL || strncmp(line, "plan", 4) != 0)
+		goto done;
+	for (char *p = strtok(line + 4, " \r\n"); p != NULL; p = strtok(NULL, " \r\n"))
+		planned.push_back(atoi(p));
+
+	// Progress. A truncated last line (crash during the write) is ignored.
+	while (fgets(line, sizeof(line), in) != NULL) {
+		int sector;
+
+		if (strchr(line, '\n') == NULL || sscanf(line + 1, "%d", &sector) != 1)
+			break;
+		if (line[0] == 'E')
+			erased.push_back(sector);
+		else if (line[0] == 'P')
+			programmed.push_back(sector);
+		else if (line[0] == 'X') {
+			// Failed verify: the sector must be erased and programmed again
+			erased.erase(std::remove(erased.begin(), erased.end(), sector), erased.end());
+			programmed.erase(std::remove(programmed.begin(), programmed.end(), sector), programmed.end());
+		}
+	}
+	valid = !planned.empty();
+
+done:
+	fclose(in);
+	if (!valid) {
+		planned.clear();
+		erased.clear();
+		programmed.clear();
+	}
+	return valid;
+}
+
+void V2495_journal::start(const char *key, const std::vector<int>& planned)
+{
+	close();
+
+	file = fopen(path.c_str(), "w");
+	if (file == NULL) {
+		fprintf(stderr, "Error opening journal %s\n", path.c_str());
+		throw cuhRetCode_FileOpen;
+	}
+
+	fprintf(file, "%s\nkey %s\nplan", JOURNAL_MAGIC, key);
+	for (size_t i = 0; i < planned.size(); i++)
+		fprintf(file, " %d", planned[i]);
+	fprintf(file, "\n");
+	sync();
+}
+
+void V2495_journal::record(char operation, int sector)
+{
+	if (file == NULL)
+		return;
+
+	if (fprintf(file, "%c %d\n", operation, sector) < 0)
+		throw cuhRetCode_Write;
+	sync();
+}
+
+void V2495_journal::remove()
+{
+	close();
+	::remove(path.c_str());
+}
+
+uint64_t V2495_journal::hash(const uint8_t *data, size_t length)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < length; i++) {
+		h ^= data[i];
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
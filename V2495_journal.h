@@ -0,0 +1,53 @@
+#ifndef V2495_JOURNAL_H
+#define V2495_JOURNAL_H
+
+#include <stdint.h> // for fixed-width integers
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Progress journal of a firmware programming, so that an interrupted
+// program_firmware can be resumed instead of restarted.
+//
+// The journal is a text file: a header with the key of the programming
+// (board, controller, region, image hash), the list of the sectors to
+// rewrite, then one line for each sector erased ("E <sector>") and
+// programmed ("P <sector>"). A sector that fails the verify is recorded
+// as "X <sector>", which cancels its previous lines. Every line is flushed to disk (fsync) before
+// the next flash operation, so the journal never claims more than what
+// was done on the flash.
+class V2495_journal
+{
+public:
+	V2495_journal(const char *path);
+	~V2495_journal();
+
+	// Read the journal. Returns 1 if it exists and was written for key,
+	// filling the planned sectors and those already erased and programmed.
+	int load(const char *key, std::vector<int>& planned, std::vector<int>& erased, std::vector<int>& programmed);
+
+	// Start a new journal (the previous content is lost). A resumed
+	// programming starts a new journal too and records again what was loaded.
+	void start(const char *key, const std::vector<int>& planned);
+
+	// Record a sector erased ('E'), programmed ('P') or to be done again ('X'), after start
+	void record(char operation, int sector);
+
+	// Delete the journal file (programming completed)
+	void remove();
+
+	const char *get_path() const { return path.c_str(); }
+
+	// FNV-1a 64 bit hash of an image
+	static uint64_t hash(const uint8_t *data, size_t length);
+
+private:
+	std::string path;
+	FILE *file;
+
+	void close();
+	void sync();
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "V2495_shadow.h"
+#include "V2495_journal.h"
+#include "cvUpgradeV2495.h"
+
+#include <cstring>
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define SHADOW_MAGIC "V2495 shadow 1"
+
+V2495_shadow::V2495_shadow(const char *path, const char *board) : path(path), board(board)
+{
+}
+
+void V2495_shadow::hash_sectors(const uint8_t *data, uint32_t length, uint32_t sector_size, std::vector<uint64_t>& sectors)
+{
+	sectors.clear();
+	for (uint32_t offset = 0; offset < length; offset += sector_size)
+		sectors.push_back(V2495_journal::hash(data + offset, (length - offset < sector_size) ? length - offset : sector_size));
+}
+
+void V2495_shadow::read_all(region_map_t& regions)
+{
+	char line[16384];
+	FILE *in;
+
+	regions.clear();
+
+	in = fopen(path.c_str(), "r");
+	if (in == NULL)
+		return;
+
+	// Header: magic and board
+	if (fgets(line, sizeof(line), in) == NULL || strncmp(line, SHADOW_MAGIC, strlen(SHADOW_MAGIC)) != 0)
+		goto done;
+	if (fgets(line, sizeof(line), in) == NULL || strncmp(line, "board ", 6) != 0)
+		goto done;
+	line[strcspn(line, "\r\n")] = '\0';
+	if (strcmp(line + 6, board.c_str()) != 0)
+		goto done;
+
+	// "<controller> <region> <length> <hashes>"
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char *content;
+
+		if (strchr(line, '\n') == NULL)
+			break;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		content = strchr(line, ' ');
+		if (content == NULL || (content = strchr(content + 1, ' ')) == NULL)
+			continue;
+		*content = '\0';
+		regions[line] = content + 1;
+	}
+
+done:
+	fclose(in);
+}
+
+void V2495_shadow::write_all(const region_map_t& regions)
+{
+	std::string temp = path + ".tmp";
+	FILE *out = fopen(temp.c_str(), "w");
+
+	if (out == NULL) {
+		fprintf(stderr, "Error opening shadow %s\n", temp.c_str());
+		throw cuhRetCode_FileOpen;
+	}
+
+	fprintf(out, "%s\nboard %s\n", SHADOW_MAGIC, board.c_str());
+	for (region_map_t::const_iterator r = regions.begin(); r != regions.end(); ++r)
+		fprintf(out, "%s %s\n", r->first.c_str(), r->second.c_str());
+
+	if (fflush(out) != 0) {
+		fclose(out);
+		throw cuhRetCode_Write;
+	}
+#ifdef WIN32
+	_commit(_fileno(out));
+	fclose(out);
+	// rename doesn't replace an existing file
+	::remove(path.c_str());
+#else
+	if (fsync(fileno(out)) != 0) {
+		fclose(out);
+		throw cuhRetCode_Write;
+	}
+	fclose(out);
+#endif
+
+	if (rename(temp.c_str(), path.c_str()) != 0)
+		throw cuhRetCode_Write;
+}
+
+int V2495_shadow::load(const char *region, uint32_t *length, std::vector<uint64_t>& sectors)
+{
+	region_map_t regions;
+	region_map_t::iterator r;
+	char *p;
+	char *end;
+
+	sectors.clear();
+
+	read_all(regions);
+	r = regions.find(region);
+	if (r == regions.end())
+		return 0;
+
+	p = &r->second[0];
+	*length = strtoul(p, &end, 10);
+	if (end == p)
+		return 0;
+
+	for (p = end; *p != '\0'; p = end) {
+		uint64_t hash = strtoull(p, &end, 16);
+
+		if (end == p)
+			break;
+		sectors.push_back(hash);
+	}
+	return 1;
+}
+
+void V2495_shadow::store(const char *region, uint32_t length, const std::vector<uint64_t>& sectors)
+{
+	region_map_t regions;
+	std::string content;
+	char field[32];
+
+	snprintf(field, sizeof(field), "%u", length);
+	content = field;
+	for (size_t i = 0; i < sectors.size(); i++) {
+		snprintf(field, sizeof(field), " %016llx", (unsigned long long)sectors[i]);
+		content += field;
+	}
+
+	read_all(regions);
+	regions[region] = content;
+	write_all(regions);
+}
+
+void V2495_shadow::forget(const char *region)
+{
+	region_map_t regions;
+
+	read_all(regions);
+	if (regions.erase(region) == 0)
+		return;
+	write_all(regions);
+}
@@ -0,0 +1,49 @@
+#ifndef V2495_SHADOW_H
+#define V2495_SHADOW_H
+
+#include <stdint.h> // for fixed-width integers
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Host side shadow of the flash of a board: for each region, the length
+// and the per sector hashes of the image last programmed there, so that
+// "is this image already on the board?" can be answered without reading
+// the region back (see V2495_flash::quick_check).
+//
+// The shadow is a text file: a header with the board it belongs to, then
+// one line per region, "<controller> <region> <length> <sector hashes>"
+// (length 0 and no hashes: the region was erased). A region is forgotten
+// before it is changed and stored again when the operation completes, so
+// an interrupted programming leaves it unknown. The file is rewritten
+// through a temporary one and renamed, never left half written.
+class V2495_shadow
+{
+public:
+	// board identifies the board (e.g. its serial number); a file written
+	// for another board is ignored
+	V2495_shadow(const char *path, const char *board);
+
+	// Recorded content of region (e.g. "user app2"). Returns 0 if it is not known.
+	int load(const char *region, uint32_t *length, std::vector<uint64_t>& sectors);
+	void store(const char *region, uint32_t length, const std::vector<uint64_t>& sectors);
+	void forget(const char *region);
+
+	// V2495_journal::hash of each sector_size block of data (the last one may be shorter)
+	static void hash_sectors(const uint8_t *data, uint32_t length, uint32_t sector_size, std::vector<uint64_t>& sectors);
+
+	const char *get_path() const { return path.c_str(); }
+
+private:
+	std::string path;
+	std::string board;
+
+	// Region -> "<length> <sector hashes>"
+	typedef std::map<std::string, std::string> region_map_t;
+
+	void read_all(region_map_t& regions);
+	void write_all(const region_map_t& regions);
+};
+
+#endif
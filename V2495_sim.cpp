@@ -0,0 +1,407 @@
+#include "V2495_sim.h"
+
+#include <cstring>
+#include <thread>
+
+V2495_sim::V2495_sim()
+{
+	for (int i = 0; i < 2; i++) {
+		controller_state_t *c = &controllers[i];
+
+		c->base = (i == MAIN_CONTROLLER) ? 0x8500 : 0x8700;
+		c->present = true;
+		c->address = 0;
+		c->payload = 0;
+		c->reboot = 0;
+		c->reboot_address = 0;
+		c->boot_address = 0;
+		c->boot_image = true;
+		c->configured_at = sim_clock::time_point();
+		c->unlock = 0;
+		c->fpga_access = 1;
+		c->flash_access = 0;
+		memset(c->bram, 0, sizeof(c->bram));
+
+		// Power-up state: factory sectors protected, as left by write_protect()
+		c->status = (i == MAIN_CONTROLLER) ? (0x0F << 2) : (0x18 << 2);
+		c->status_latch = 0;
+	}
+
+	// No latency by default: the model runs as fast as possible
+	call_latency_us = 0;
+	word_latency_ns = 0;
+	page_program_us = 0;
+	sector_erase_us = 0;
+	status_write_us = 0;
+	read_page_us = 0;
+	// Except for the FPGA configuration: a reboot must be seen (the design
+	// register doesn't answer for a while) by V2495_flash::wait_healthy
+	configuration_us = 20000;
+
+	block_transfer = true;
+
+	reset_counters();
+}
+
+V2495_sim::~V2495_sim()
+{
+}
+
+void V2495_sim::set_call_latency(uint32_t us) { call_latency_us = us; }
+void V2495_sim::set_word_latency(uint32_t ns) { word_latency_ns = ns; }
+void V2495_sim::set_page_program_time(uint32_t us) { page_program_us = us; }
+void V2495_sim::set_sector_erase_time(uint32_t us) { sector_erase_us = us; }
+void V2495_sim::set_status_write_time(uint32_t us) { status_write_us = us; }
+void V2495_sim::set_read_page_time(uint32_t us) { read_page_us = us; }
+void V2495_sim::set_configuration_time(uint32_t us) { configuration_us = us; }
+
+void V2495_sim::set_block_transfer(bool enable) { block_transfer = enable; }
+
+void V2495_sim::set_controller_present(sim_controller_t controller, bool present) {
+	std::lock_guard<std::mutex> guard(lock);
+	controllers[controller].present = present;
+}
+
+void V2495_sim::flash_read(sim_controller_t controller, uint32_t address, uint8_t *buf, uint32_t length) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::vector<uint8_t>& flash = flash_array(&controllers[controller]);
+
+	for (uint32_t i = 0; i < length; i++)
+		buf[i] = flash[(address + i) % FLASH_SIZE];
+}
+
+void V2495_sim::flash_write(sim_controller_t controller, uint32_t address, const uint8_t *buf, uint32_t length) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::vector<uint8_t>& flash = flash_array(&controllers[controller]);
+
+	for (uint32_t i = 0; i < length; i++)
+		flash[(address + i) % FLASH_SIZE] = buf[i];
+}
+
+uint8_t V2495_sim::get_flash_status(sim_controller_t controller) {
+	std::lock_guard<std::mutex> guard(lock);
+	controller_state_t *c = &controllers[controller];
+
+	return c->status | (flash_busy(c) ? STATUS_WIP : 0);
+}
+
+void V2495_sim::get_counters(counters_t *counters) {
+	std::lock_guard<std::mutex> guard(lock);
+	*counters = this->counters;
+}
+
+uint32_t V2495_sim::get_boot_address(sim_controller_t controller) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	return controllers[controller].boot_address;
+}
+
+bool V2495_sim::is_configured(sim_controller_t controller) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	return fpga_configured(&controllers[controller]);
+}
+
+void V2495_sim::reset_counters() {
+	memset(&counters, 0, sizeof(counters));
+}
+
+V2495_sim::controller_state_t *V2495_sim::find_controller(uint32_t address) {
+	for (int i = 0; i < 2; i++) {
+		if (address >= controllers[i].base && address < controllers[i].base + CONTROLLER_WINDOW)
+			return &controllers[i];
+	}
+	return NULL;
+}
+
+std::vector<uint8_t>& V2495_sim::flash_array(controller_state_t *c) {
+	if (c->flash.empty())
+		c->flash.assign(FLASH_SIZE, 0xFF);
+	return c->flash;
+}
+
+// Number of protected sectors (starting from sector 0) for a
+// given value of the protection bits of the status register.
+uint32_t V2495_sim::protected_sectors(uint8_t status) {
+	switch (status & STATUS_PROTECTION_MASK) {
+	case (0x0F << 2):
+		return 64;
+	case (0x18 << 2):
+		return 128;
+	default:
+		return 0;
+	}
+}
+
+bool V2495_sim::fpga_configured(controller_state_t *c) {
+	return c->boot_image && sim_clock::now() >= c->configured_at;
+}
+
+bool V2495_sim::flash_busy(controller_state_t *c) {
+	return sim_clock::now() < c->flash_busy_until;
+}
+
+void V2495_sim::execute(controller_state_t *c, uint32_t opcode) {
+	sim_clock::time_point now = sim_clock::now();
+	uint32_t length = (c->payload & 0xFF) + 1;
+	uint8_t *bram = (uint8_t *)c->bram;
+
+	// The controller accepts commands only when unlocked and
+	// connected to the flash, and not while it is still executing
+	// the previous one. The flash ignores everything but status
+	// reads while a program/erase cycle is in progress.
+	if (c->unlock != UNLOCK_KEY || !c->flash_access || now < c->controller_busy_until) {
+		counters.ignored_commands++;
+		return;
+	}
+
+	if (flash_busy(c) && opcode != READ_STATUS_OPCODE && opcode != RESET_CONTROLLER_OPCODE && opcode != NOP_OPCODE) {
+		counters.ignored_commands++;
+		return;
+	}
+
+	switch (opcode) {
+	case RESET_CONTROLLER_OPCODE:
+		c->controller_busy_until = now;
+		c->status &= ~STATUS_WEL;
+		break;
+
+	case WRITE_ENABLE_OPCODE:
+		c->status |= STATUS_WEL;
+		break;
+
+	case READ_STATUS_OPCODE:
+		c->status_latch = c->status | (flash_busy(c) ? STATUS_WIP : 0);
+		break;
+
+	case SECTOR_ERASE_OPCODE:
+	case WRITE_PAGE_OPCODE:
+	case WRITE_STATUS_OPCODE:
+		if (!(c->status & STATUS_WEL)) {
+			counters.ignored_commands++;
+			return;
+		}
+		c->status &= ~STATUS_WEL;
+
+		if (opcode == WRITE_STATUS_OPCODE) {
+			c->status = (c->status & ~STATUS_PROTECTION_MASK) | (c->address & STATUS_PROTECTION_MASK);
+			c->flash_busy_until = now + std::chrono::microseconds(status_write_us);
+			break;
+		}
+
+		if ((c->address % FLASH_SIZE) / SECTOR_SIZE < protected_sectors(c->status)) {
+			counters.ignored_commands++;
+			return;
+		}
+
+		if (opcode == SECTOR_ERASE_OPCODE) {
+			std::vector<uint8_t>& flash = flash_array(c);
+			uint32_t sector_address = (c->address % FLASH_SIZE) & ~(SECTOR_SIZE - 1);
+
+			memset(&flash[sector_address], 0xFF, SECTOR_SIZE);
+			c->flash_busy_until = now + std::chrono::microseconds(sector_erase_us);
+		}
+		else {
+			// Page program: bits can only go from 1 to 0 and
+			// the address wraps inside the 256 bytes page.
+			std::vector<uint8_t>& flash = flash_array(c);
+			uint32_t page_address = (c->address % FLASH_SIZE) & ~(PAGE_SIZE - 1);
+
+			for (uint32_t i = 0; i < length; i++)
+				flash[page_address + ((c->address + i) & (PAGE_SIZE - 1))] &= bram[i];
+			c->flash_busy_until = now + std::chrono::microseconds(page_program_us);
+		}
+		break;
+
+	case READ_PAGE_OPCODE: {
+		std::vector<uint8_t>& flash = flash_array(c);
+
+		for (uint32_t i = 0; i < length; i++)
+			bram[i] = flash[(c->address + i) % FLASH_SIZE];
+		c->controller_busy_until = now + std::chrono::microseconds(read_page_us);
+		break;
+	}
+
+	case NOP_OPCODE:
+		break;
+
+	default:
+		counters.ignored_commands++;
+		return;
+	}
+
+	counters.commands[opcode]++;
+}
+
+int32_t V2495_sim::write_register(uint32_t address, uint32_t data) {
+	controller_state_t *c = find_controller(address);
+	uint32_t offset;
+
+	if (c == NULL)
+		return CAENComm_VMEBusError;
+
+	offset = address - c->base;
+
+	if (offset >= BRAM_START_OFFSET) {
+		c->bram[(offset - BRAM_START_OFFSET) / 4] = data;
+		return CAENComm_Success;
+	}
+
+	switch (offset) {
+	case OPCODE_OFFSET:         execute(c, data & 0xF); break;
+	case ADDRESS_OFFSET:        c->address = data; break;
+	case PAYLOAD_OFFSET:        c->payload = data; break;
+	case REBOOT_OFFSET:
+		c->reboot = data;
+		// The FPGA is configured only when it owns the flash
+		if ((data & 1) && c->fpga_access && !c->flash_access) {
+			std::vector<uint8_t>& flash = flash_array(c);
+			uint32_t address = c->reboot_address % FLASH_SIZE;
+
+			c->boot_address = c->reboot_address;
+			c->boot_image = false;
+			for (uint32_t i = 0; i < PAGE_SIZE && address + i < FLASH_SIZE; i++) {
+				if (flash[address + i] != 0xFF) {
+					c->boot_image = true;
+					break;
+				}
+			}
+			c->configured_at = sim_clock::now() + std::chrono::microseconds(configuration_us);
+			counters.reboots++;
+		}
+		break;
+	case REBOOT_ADDRESS_OFFSET: c->reboot_address = data; break;
+	case UNLOCK_OFFSET:         c->unlock = data; break;
+	case FPGA_ACCESS_OFFSET:    c->fpga_access = data & 1; break;
+	case FLASH_ACCESS_OFFSET:   c->flash_access = data & 1; break;
+	default:
+		return CAENComm_VMEBusError;
+	}
+
+	return CAENComm_Success;
+}
+
+int32_t V2495_sim::read_register(uint32_t address, uint32_t *data) {
+	controller_state_t *c = find_controller(address);
+	uint32_t offset;
+
+	if (address == MAIN_DESIGN_ADDRESS || address == USER_DESIGN_ADDRESS) {
+		c = &controllers[(address == USER_DESIGN_ADDRESS) ? USER_CONTROLLER : MAIN_CONTROLLER];
+		if (!fpga_configured(c))
+			return CAENComm_VMEBusError;
+		*data = DESIGN_ID;
+		return CAENComm_Success;
+	}
+
+	if (c == NULL)
+		return CAENComm_VMEBusError;
+
+	offset = address - c->base;
+
+	if (offset >= BRAM_START_OFFSET) {
+		*data = c->bram[(offset - BRAM_START_OFFSET) / 4];
+		return CAENComm_Success;
+	}
+
+	switch (offset) {
+	case OPCODE_OFFSET:
+		// bits 7..1: controller busy, bits 15..8: last status read
+		*data = ((sim_clock::now() < c->controller_busy_until) ? 0x02 : 0) | ((uint32_t)c->status_latch << 8);
+		break;
+	case ADDRESS_OFFSET:        *data = c->address; break;
+	case PAYLOAD_OFFSET:        *data = c->payload; break;
+	case REBOOT_OFFSET:         *data = c->reboot; break;
+	case REBOOT_ADDRESS_OFFSET: *data = c->reboot_address; break;
+	case UNLOCK_OFFSET:         *data = c->unlock; break;
+	case FPGA_ACCESS_OFFSET:    *data = c->fpga_access; break;
+	case FLASH_ACCESS_OFFSET:   *data = c->flash_access; break;
+	case IDCODE_OFFSET:         *data = c->present ? IDCODE : 0; break;
+	default:
+		return CAENComm_VMEBusError;
+	}
+
+	return CAENComm_Success;
+}
+
+void V2495_sim::transaction_delay(int32_t words) {
+	uint64_t ns = (uint64_t)call_latency_us * 1000 + (uint64_t)word_latency_ns * words;
+
+	counters.transactions++;
+	if (ns > 0)
+		std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+}
+
+int32_t V2495_sim::Write32(uint32_t address, uint32_t data) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	transaction_delay(1);
+	counters.words_written++;
+	return write_register(address, data);
+}
+
+int32_t V2495_sim::Read32(uint32_t address, uint32_t *data) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	transaction_delay(1);
+	counters.words_read++;
+	return read_register(address, data);
+}
+
+int32_t V2495_sim::MultiWrite32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) {
+	std::lock_guard<std::mutex> guard(lock);
+	int32_t ret = CAENComm_Success;
+
+	transaction_delay(count);
+	counters.words_written += count;
+	for (int32_t i = 0; i < count; i++) {
+		errs[i] = (CAENComm_ErrorCode)write_register(addresses[i], datas[i]);
+		if (errs[i] != CAENComm_Success)
+			ret = CAENComm_VMEBusError;
+	}
+	return ret;
+}
+
+int32_t V2495_sim::MultiRead32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) {
+	std::lock_guard<std::mutex> guard(lock);
+	int32_t ret = CAENComm_Success;
+
+	transaction_delay(count);
+	counters.words_read += count;
+	for (int32_t i = 0; i < count; i++) {
+		errs[i] = (CAENComm_ErrorCode)read_register(addresses[i], &datas[i]);
+		if (errs[i] != CAENComm_Success)
+			ret = CAENComm_VMEBusError;
+	}
+	return ret;
+}
+
+int32_t V2495_sim::block_read(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) {
+	std::lock_guard<std::mutex> guard(lock);
+	int32_t words = size / 4;
+
+	*nw = 0;
+	if (!block_transfer)
+		return CAENComm_NotSupported;
+
+	transaction_delay(words);
+	for (int32_t i = 0; i < words; i++) {
+		if (read_register(address + 4 * i, &buf[i]) != CAENComm_Success)
+			return CAENComm_VMEBusError;
+		(*nw)++;
+	}
+	counters.words_read += words;
+	return CAENComm_Success;
+}
+
+int32_t V2495_sim::BLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) {
+	return block_read(address, buf, size, nw);
+}
+
+int32_t V2495_sim::MBLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) {
+	// 64 bit transfers: size must be a multiple of 8 bytes
+	if (size % 8) {
+		*nw = 0;
+		return CAENComm_InvalidParam;
+	}
+	return block_read(address, buf, size, nw);
+}
@@ -0,0 +1,179 @@
+#ifndef V2495_SIM_H
+#define V2495_SIM_H
+
+#include "V2495_transport.h"
+
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+// Software model of the V2495 flash controllers (main at 0x8500, user at 0x8700)
+// and of the SPI flash chip behind each one. It is used as a V2495_transport,
+// so V2495_flash can be run and profiled without a board.
+//
+// The model covers:
+//  - the opcode state machine (write enable, status, erase, page program, read, reset)
+//  - the 256 bytes BRAM window at BRAM_START_OFFSET
+//  - a 32MB flash array per controller, erased to 0xFF, where programming
+//    can only clear bits and erase works on 64KB sectors
+//  - the WIP/WEL status bits and the sector protection bits
+//  - a configurable latency for each register transaction and for each flash operation
+class V2495_sim : public V2495_transport
+{
+public:
+	typedef enum {MAIN_CONTROLLER = 0, USER_CONTROLLER = 1} sim_controller_t;
+
+	// Transaction and command counters
+	typedef struct {
+		uint64_t transactions;     // Write32/Read32/MultiWrite32/MultiRead32/BLT calls
+		uint64_t words_written;
+		uint64_t words_read;
+		uint64_t commands[16];     // accepted commands, by opcode
+		uint64_t ignored_commands; // commands dropped (busy, locked, write not enabled, protected)
+		uint64_t reboots;          // FPGA configurations started through REBOOT_OFFSET
+	} counters_t;
+
+	const static uint32_t FLASH_SIZE = 32 * 1024 * 1024; // 512 sectors of 64KB
+
+	// A register of each FPGA design, outside the flash controllers (for
+	// the health check after a reboot): it reads DESIGN_ID while the FPGA
+	// runs an image, and gives a bus error while it configures
+	const static uint32_t MAIN_DESIGN_ADDRESS = 0x8100;
+	const static uint32_t USER_DESIGN_ADDRESS = 0x1000;
+	const static uint32_t DESIGN_ID = 0x2495D001;
+
+	V2495_sim();
+	~V2495_sim();
+
+	// Latency model. All times in microseconds.
+	void set_call_latency(uint32_t us);      // fixed cost of each register transaction
+	void set_word_latency(uint32_t ns);      // additional cost of each 32 bit word moved (nanoseconds)
+	void set_page_program_time(uint32_t us);
+	void set_sector_erase_time(uint32_t us);
+	void set_status_write_time(uint32_t us);
+	void set_read_page_time(uint32_t us);    // controller busy time after READ_PAGE
+	void set_configuration_time(uint32_t us); // FPGA configuration after REBOOT (default 20 ms)
+
+	// Emulate a link with or without block transfer support
+	void set_block_transfer(bool enable);
+
+	// Controller mapped/unmapped (IDCODE reads 0 when not present)
+	void set_controller_present(sim_controller_t controller, bool present);
+
+	// Direct access to the flash array, without latency. Used to
+	// prepare and check the flash content.
+	void flash_read(sim_controller_t controller, uint32_t address, uint8_t *buf, uint32_t length);
+	void flash_write(sim_controller_t controller, uint32_t address, const uint8_t *buf, uint32_t length);
+	uint8_t get_flash_status(sim_controller_t controller);
+	// Flash address the FPGA was last configured from (REBOOT_ADDRESS_OFFSET
+	// when REBOOT_OFFSET was written), 0 at power up
+	uint32_t get_boot_address(sim_controller_t controller);
+	// After a reboot the design register doesn't answer until the
+	// configuration time has passed, and never does if the first page at
+	// the boot address is blank (no image). The controller stays up.
+	bool is_configured(sim_controller_t controller);
+
+	void get_counters(counters_t *counters);
+	void reset_counters();
+
+	int32_t Write32(uint32_t address, uint32_t data);
+	int32_t Read32(uint32_t address, uint32_t *data);
+
+	int32_t MultiWrite32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs);
+	int32_t MultiRead32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs);
+
+	int32_t BLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw);
+	int32_t MBLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw);
+
+private:
+	typedef std::chrono::steady_clock sim_clock;
+
+	// Register map of a controller (same as V2495_flash)
+	const static uint32_t CONTROLLER_WINDOW        = 0x200;
+	const static uint32_t OPCODE_OFFSET            = 0x00;
+	const static uint32_t ADDRESS_OFFSET           = 0x04;
+	const static uint32_t PAYLOAD_OFFSET           = 0x08;
+	const static uint32_t REBOOT_OFFSET            = 0x0C;
+	const static uint32_t REBOOT_ADDRESS_OFFSET    = 0x10;
+	const static uint32_t UNLOCK_OFFSET            = 0x14;
+	const static uint32_t FPGA_ACCESS_OFFSET       = 0x18;
+	const static uint32_t FLASH_ACCESS_OFFSET      = 0x1C;
+	const static uint32_t IDCODE_OFFSET            = 0xF0;
+	const static uint32_t BRAM_START_OFFSET        = 0x100;
+
+	const static uint32_t RESET_CONTROLLER_OPCODE  = 0;
+	const static uint32_t WRITE_ENABLE_OPCODE      = 1;
+	const static uint32_t READ_STATUS_OPCODE       = 2;
+	const static uint32_t SECTOR_ERASE_OPCODE      = 3;
+	const static uint32_t WRITE_PAGE_OPCODE        = 4;
+	const static uint32_t READ_PAGE_OPCODE         = 5;
+	const static uint32_t WRITE_STATUS_OPCODE      = 6;
+	const static uint32_t NOP_OPCODE               = 15;
+
+	const static uint32_t IDCODE                   = 0xCAEF2495;
+	const static uint32_t UNLOCK_KEY               = 0xABBA5511;
+
+	const static uint32_t PAGE_SIZE                = 256;
+	const static uint32_t SECTOR_SIZE              = 64 * 1024;
+
+	// Flash status register bits
+	const static uint8_t  STATUS_WIP               = 0x01;
+	const static uint8_t  STATUS_WEL               = 0x02;
+	const static uint8_t  STATUS_PROTECTION_MASK   = 0xFC;
+
+	typedef struct {
+		uint32_t base;
+		bool present;
+
+		uint32_t address;
+		uint32_t payload;
+		uint32_t reboot;
+		uint32_t reboot_address;
+		uint32_t boot_address;
+		bool boot_image;        // an image was found at boot_address
+		sim_clock::time_point configured_at;
+		uint32_t unlock;
+		uint32_t fpga_access;
+		uint32_t flash_access;
+		uint32_t bram[PAGE_SIZE / 4];
+
+		uint8_t status;         // flash status register (WIP computed from flash_busy_until)
+		uint8_t status_latch;   // status read by the last READ_STATUS command
+
+		sim_clock::time_point flash_busy_until;
+		sim_clock::time_point controller_busy_until;
+
+		std::vector<uint8_t> flash; // allocated on first access
+	} controller_state_t;
+
+	controller_state_t controllers[2];
+
+	uint32_t call_latency_us;
+	uint32_t word_latency_ns;
+	uint32_t page_program_us;
+	uint32_t sector_erase_us;
+	uint32_t status_write_us;
+	uint32_t read_page_us;
+	uint32_t configuration_us;
+
+	bool block_transfer;
+
+	counters_t counters;
+
+	std::mutex lock;
+
+	controller_state_t *find_controller(uint32_t address);
+	std::vector<uint8_t>& flash_array(controller_state_t *c);
+	uint32_t protected_sectors(uint8_t status);
+	bool flash_busy(controller_state_t *c);
+	bool fpga_configured(controller_state_t *c);
+
+	void execute(controller_state_t *c, uint32_t opcode);
+	int32_t write_register(uint32_t address, uint32_t data);
+	int32_t read_register(uint32_t address, uint32_t *data);
+
+	void transaction_delay(int32_t words);
+	int32_t block_read(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw);
+};
+
+#endif
@@ -0,0 +1,298 @@
+#include "V2495_slots.h"
+#include "V2495_journal.h"
+#include "cvUpgradeV2495.h"
+
+#include <cstring>
+#include <vector>
+
+// Record layout (little endian):
+//   0  magic "V2495SLT"
+//   8  sequence
+//  12  use counter
+//  16  SLOTS x { hash (8), length (4), last_used (4) }
+//  96  V2495_journal::hash of bytes 0 - 95 (low 32 bits)
+// The rest of the page is left erased.
+static const char RECORD_MAGIC[8] = { 'V', '2', '4', '9', '5', 'S', 'L', 'T' };
+static const uint32_t RECORD_SLOTS_OFFSET = 16;
+static const uint32_t RECORD_CHECKSUM_OFFSET = 96;
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+V2495_slots::V2495_slots(V2495_flash& flash) : flash(flash)
+{
+	address = flash.get_free_area_address();
+	loaded = 0;
+	last_record = -1;
+	sequence = 0;
+	use_counter = 0;
+	memset(slots, 0, sizeof(slots));
+}
+
+V2495_flash::fw_region_t V2495_slots::slot_region(int slot)
+{
+	static const V2495_flash::fw_region_t regions[SLOTS] = {
+		V2495_flash::APPLICATION1_FW_REGION, V2495_flash::APPLICATION2_FW_REGION, V2495_flash::APPLICATION3_FW_REGION,
+		V2495_flash::APPLICATION4_FW_REGION, V2495_flash::APPLICATION5_FW_REGION };
+
+	if (slot < 0 || slot >= SLOTS)
+		throw cuhRetCode_InvalidRegion;
+
+	return regions[slot];
+}
+
+int V2495_slots::is_blank(const uint8_t *record)
+{
+	for (uint32_t i = 0; i < RECORD_SIZE; i++) {
+		if (record[i] != 0xFF)
+			return 0;
+	}
+	return 1;
+}
+
+void V2495_slots::encode(uint8_t *record)
+{
+	memset(record, 0xFF, RECORD_SIZE);
+	memcpy(record, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+	put_u32(record + 8, sequence);
+	put_u32(record + 12, use_counter);
+
+	for (int i = 0; i < SLOTS; i++) {
+		uint8_t *p = record + RECORD_SLOTS_OFFSET + 16 * i;
+
+		put_u32(p, (uint32_t)slots[i].hash);
+		put_u32(p + 4, (uint32_t)(slots[i].hash >> 32));
+		put_u32(p + 8, slots[i].length);
+		put_u32(p + 12, slots[i].last_used);
+	}
+	put_u32(record + RECORD_CHECKSUM_OFFSET, (uint32_t)V2495_journal::hash(record, RECORD_CHECKSUM_OFFSET));
+}
+
+int V2495_slots::decode(const uint8_t *record)
+{
+	if (memcmp(record, RECORD_MAGIC, sizeof(RECORD_MAGIC)) != 0)
+		return 0;
+	// A page program interrupted half way
+	if (get_u32(record + RECORD_CHECKSUM_OFFSET) != (uint32_t)V2495_journal::hash(record, RECORD_CHECKSUM_OFFSET))
+		return 0;
+
+	sequence = get_u32(record + 8);
+	use_counter = get_u32(record + 12);
+
+	for (int i = 0; i < SLOTS; i++) {
+		const uint8_t *p = record + RECORD_SLOTS_OFFSET + 16 * i;
+
+		slots[i].hash = get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+		slots[i].length = get_u32(p + 8);
+		slots[i].last_used = get_u32(p + 12);
+	}
+	return 1;
+}
+
+void V2495_slots::load()
+{
+	uint8_t record[RECORD_SIZE];
+	int low = 0;
+	int high = RECORDS;
+
+	if (loaded)
+		return;
+
+	// Records are appended in page order: binary search of the first blank page
+	while (low < high) {
+		int mid = (low + high) / 2;
+
+		flash.read_page(address + mid * RECORD_SIZE, record);
+		if (is_blank(record))
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	last_record = low - 1;
+	memset(slots, 0, sizeof(slots));
+	sequence = 0;
+	use_counter = 0;
+
+	// The last record may be damaged: fall back to the previous ones
+	for (int page = last_record; page >= 0; page--) {
+		flash.read_page(address + page * RECORD_SIZE, record);
+		if (decode(record))
+			break;
+		memset(slots, 0, sizeof(slots));
+	}
+	loaded = 1;
+}
+
+void V2495_slots::save()
+{
+	uint8_t record[RECORD_SIZE];
+
+	sequence++;
+	encode(record);
+
+	if (last_record + 1 >= RECORDS) {
+		flash.sector_erase(address);
+		last_record = -1;
+	}
+	last_record++;
+	flash.write_page(address + last_record * RECORD_SIZE, record);
+}
+
+void V2495_slots::hash_file(char *filename, uint64_t *hash, uint32_t *length)
+{
+	FILE *f = fopen(filename, "rb");
+	std::vector<uint8_t> data;
+	long size;
+
+	if (f == NULL)
+		throw cuhRetCode_FileOpen;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size <= 0) {
+		fclose(f);
+		throw cuhRetCode_InvalidFile;
+	}
+
+	data.resize(size);
+	if (fread(&data[0], 1, size, f) != (size_t)size) {
+		fclose(f);
+		throw cuhRetCode_InvalidFile;
+	}
+	fclose(f);
+
+	*hash = V2495_journal::hash(&data[0], data.size());
+	*length = (uint32_t)size;
+}
+
+int V2495_slots::least_recently_used(int exclude)
+{
+	int lru = -1;
+
+	for (int i = 0; i < SLOTS; i++) {
+		if (i == exclude)
+			continue;
+		if (slots[i].hash == 0)
+			return i;
+		if (lru < 0 || slots[i].last_used < slots[lru].last_used)
+			lru = i;
+	}
+	return lru;
+}
+
+int V2495_slots::running_slot()
+{
+	V2495_flash::fw_region_t region;
+
+	if (!flash.get_boot_region(&region))
+		return -1;
+	for (int i = 0; i < SLOTS; i++) {
+		if (slot_region(i) == region)
+			return i;
+	}
+	return -1;
+}
+
+int V2495_slots::find_image(uint64_t hash, uint32_t length)
+{
+	load();
+
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].hash == hash && slots[i].length == length)
+			return i;
+	}
+	return -1;
+}
+
+int V2495_slots::find(char *filename)
+{
+	uint64_t hash;
+	uint32_t length;
+
+	hash_file(filename, &hash, &length);
+	return find_image(hash, length);
+}
+
+void V2495_slots::forget(int slot)
+{
+	slot_region(slot);
+	load();
+
+	if (slots[slot].hash == 0)
+		return;
+	memset(&slots[slot], 0, sizeof(slot_t));
+	save();
+}
+
+const V2495_slots::slot_t& V2495_slots::get(int slot)
+{
+	slot_region(slot);
+	load();
+	return slots[slot];
+}
+
+V2495_flash::fw_region_t V2495_slots::activate(char *filename)
+{
+	uint64_t hash;
+	uint32_t length;
+	int slot;
+	int running;
+
+	flash.acquire_flash_access();
+	running = running_slot();
+
+	hash_file(filename, &hash, &length);
+	slot = find_image(hash, length);
+
+	// The table doesn't see what other tools wrote in the slots: a few
+	// pages read back confirm the slot still holds the image
+	if (slot >= 0 && flash.spot_check(slot_region(slot), filename))
+		flash.message(stdout, "%s is already in slot %d (%s).\n", filename, slot + 1, V2495_flash::region_name(slot_region(slot)));
+	else {
+		// Never overwrite the image the FPGA runs (e.g. after a reboot
+		// that didn't go through activate): it is the one to roll back to
+		if (slot < 0 || slot == running)
+			slot = least_recently_used(running);
+		flash.message(stdout, "Programming %s in slot %d (%s).\n", filename, slot + 1, V2495_flash::region_name(slot_region(slot)));
+
+		// Until the programming is verified the slot holds no known image
+		if (slots[slot].hash != 0) {
+			memset(&slots[slot], 0, sizeof(slot_t));
+			save();
+		}
+
+		flash.program_firmware(slot_region(slot), filename, 1);
+
+		slots[slot].hash = hash;
+		slots[slot].length = length;
+	}
+
+	slots[slot].last_used = ++use_counter;
+	save();
+
+	flash.reboot_with_rollback(slot_region(slot));
+	return slot_region(slot);
+}
+
+void V2495_slots::print(FILE *out)
+{
+	load();
+
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].hash == 0)
+			fprintf(out, "Slot %d (%s): empty\n", i + 1, V2495_flash::region_name(slot_region(i)));
+		else
+			fprintf(out, "Slot %d (%s): hash=%016llx length=%u last used=%u\n", i + 1, V2495_flash::region_name(slot_region(i)),
+			        (unsigned long long)slots[i].hash, slots[i].length, slots[i].last_used);
+	}
+}
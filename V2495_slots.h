@@ -0,0 +1,83 @@
+#ifndef V2495_SLOTS_H
+#define V2495_SLOTS_H
+
+#include <stdint.h> // for fixed-width integers
+#include <stdio.h>
+#include "V2495_flash.h"
+
+// Cache of user firmware images in the five application slots of the user
+// flash (APPLICATION1..5), so that switching between images already
+// programmed is just a reconfiguration of the FPGA from another slot.
+//
+// The table of the slots (hash and length of the image in each one, and
+// when it was last used) is kept in the first sector of the free area
+// (sector 458) as a log of 256 bytes records: every update programs the
+// next blank page, and the sector is erased only when it is full. The
+// last valid record is the current table.
+class V2495_slots
+{
+public:
+	const static int SLOTS = 5;
+
+	typedef struct {
+		uint64_t hash;      // V2495_journal::hash of the image file, 0: slot unknown
+		uint32_t length;    // of the image file
+		uint32_t last_used; // value of the use counter when last activated
+	} slot_t;
+
+	// flash must be a user controller object
+	V2495_slots(V2495_flash& flash);
+
+	// Reconfigure the user FPGA with the image in filename: from the slot
+	// holding it if there is one (and a few pages read back confirm it, see
+	// V2495_flash::spot_check), otherwise after programming it (with
+	// verify) in that slot, or in an empty or the least recently used one.
+	// The slot the FPGA is running from is never overwritten. Returns the
+	// region the FPGA was configured from. If the image doesn't pass the
+	// health check the FPGA goes back to the previous one (see
+	// V2495_flash::reboot_with_rollback).
+	V2495_flash::fw_region_t activate(char *filename);
+
+	// Slot (0 .. SLOTS-1) holding the image in filename, -1 if none
+	int find(char *filename);
+	// Mark a slot as unknown (e.g. it was programmed by other means)
+	void forget(int slot);
+
+	const slot_t& get(int slot);
+	static V2495_flash::fw_region_t slot_region(int slot);
+
+	// One line per slot
+	void print(FILE *out);
+
+private:
+	const static uint32_t RECORD_SIZE = 256; // one flash page
+	const static int RECORDS = 64 * 1024 / RECORD_SIZE;
+
+	V2495_flash& flash;
+	uint32_t address; // of the metadata sector
+
+	int loaded;
+	int last_record;      // page of the current table, -1 if the sector is blank
+	uint32_t sequence;    // of the current table
+	uint32_t use_counter;
+	slot_t slots[SLOTS];
+
+	// Read the current table from the flash (once)
+	void load();
+	// Append the table as a new record
+	void save();
+
+	static void hash_file(char *filename, uint64_t *hash, uint32_t *length);
+	int find_image(uint64_t hash, uint32_t length);
+	// Empty or least recently used slot other than exclude
+	int least_recently_used(int exclude);
+	// Slot the FPGA was last configured from, -1 if none (e.g. boot)
+	int running_slot();
+
+	// Record <-> table. decode returns 0 if the record is not valid.
+	void encode(uint8_t *record);
+	int decode(const uint8_t *record);
+	static int is_blank(const uint8_t *record);
+};
+
+#endif
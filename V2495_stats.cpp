@@ -0,0 +1,153 @@
+#include "V2495_stats.h"
+
+#include <cstring>
+
+V2495_stats::V2495_stats()
+{
+	reset();
+}
+
+bool V2495_stats::enabled()
+{
+#ifdef V2495_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+void V2495_stats::reset()
+{
+	current_phase = PHASE_OTHER;
+	memset(ops, 0, sizeof(ops));
+}
+
+void V2495_stats::record(op_t op, uint32_t words, timestamp_t started)
+{
+	op_stats_t *s = &ops[current_phase][op];
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 0 && bucket < HISTOGRAM_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	s->calls++;
+	s->words += words;
+	s->total_ns += ns;
+	s->histogram[bucket]++;
+}
+
+void V2495_stats::merge(const V2495_stats& other)
+{
+	for (int p = 0; p < PHASE_COUNT; p++) {
+		for (int o = 0; o < OP_COUNT; o++) {
+			op_stats_t *s = &ops[p][o];
+			const op_stats_t *t = &other.ops[p][o];
+
+			s->calls += t->calls;
+			s->words += t->words;
+			s->polls += t->polls;
+			s->total_ns += t->total_ns;
+			for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+				s->histogram[b] += t->histogram[b];
+		}
+	}
+}
+
+const char *V2495_stats::phase_name(phase_t phase)
+{
+	static const char *names[PHASE_COUNT] = { "other", "load", "unprotect", "erase", "program", "verify", "protect" };
+
+	return names[phase];
+}
+
+const char *V2495_stats::op_name(op_t op)
+{
+	static const char *names[OP_COUNT] = { "write_register", "read_register", "multi_write_register",
+	                                       "multi_read_register", "block_read_register", "wait_controller", "wait_flash" };
+
+	return names[op];
+}
+
+uint64_t V2495_stats::percentile_us(const op_stats_t& s, double p)
+{
+	uint64_t target = (uint64_t)(s.calls * p / 100.0 + 0.5);
+	uint64_t count = 0;
+
+	if (target == 0)
+		target = 1;
+
+	for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		count += s.histogram[b];
+		if (count >= target)
+			return (uint64_t)1 << b;
+	}
+	return (uint64_t)1 << (HISTOGRAM_BUCKETS - 1);
+}
+
+// Percentiles are the upper bound of the histogram bucket
+void V2495_stats::print(FILE *out, const char *prefix) const
+{
+	fprintf(out, "%s%-10s %-21s %9s %10s %8s %11s %9s %9s %9s\n", prefix,
+	        "PHASE", "OPERATION", "CALLS", "WORDS", "POLLS", "TOTAL [ms]", "MEAN [us]", "P50 [us]", "P99 [us]");
+
+	for (int p = 0; p < PHASE_COUNT; p++) {
+		for (int o = 0; o < OP_COUNT; o++) {
+			const op_stats_t& s = ops[p][o];
+
+			if (s.calls == 0 && s.polls == 0)
+				continue;
+
+			fprintf(out, "%s%-10s %-21s %9llu %10llu %8llu %11.1f %9.1f %9llu %9llu\n", prefix,
+			        phase_name((phase_t)p), op_name((op_t)o),
+			        (unsigned long long)s.calls, (unsigned long long)s.words, (unsigned long long)s.polls,
+			        s.total_ns / 1e6, (s.calls > 0) ? s.total_ns / 1e3 / s.calls : 0,
+			        (unsigned long long)percentile_us(s, 50), (unsigned long long)percentile_us(s, 99));
+		}
+	}
+}
+
+void V2495_stats::write_json(FILE *out, const char *indent) const
+{
+	bool first_phase = true;
+
+	fprintf(out, "{");
+	for (int p = 0; p < PHASE_COUNT; p++) {
+		bool first_op = true;
+
+		for (int o = 0; o < OP_COUNT; o++) {
+			const op_stats_t& s = ops[p][o];
+			bool first_bucket = true;
+
+			if (s.calls == 0 && s.polls == 0)
+				continue;
+
+			if (first_op) {
+				fprintf(out, "%s\n%s  \"%s\": {", first_phase ? "" : ",", indent, phase_name((phase_t)p));
+				first_phase = false;
+			}
+			fprintf(out, "%s\n%s    \"%s\": {\"calls\": %llu, \"words\": %llu, \"polls\": %llu, \"total_us\": %.1f, \"histogram_us\": {",
+			        first_op ? "" : ",", indent, op_name((op_t)o),
+			        (unsigned long long)s.calls, (unsigned long long)s.words, (unsigned long long)s.polls, s.total_ns / 1e3);
+			first_op = false;
+
+			// Keyed by the bucket upper bound
+			for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+				if (s.histogram[b] == 0)
+					continue;
+				fprintf(out, "%s\"%llu\": %llu", first_bucket ? "" : ", ",
+				        (unsigned long long)1 << b, (unsigned long long)s.histogram[b]);
+				first_bucket = false;
+			}
+			fprintf(out, "}}");
+		}
+		if (!first_op)
+			fprintf(out, "\n%s  }", indent);
+	}
+	if (!first_phase)
+		fprintf(out, "\n%s", indent);
+	fprintf(out, "}");
+}
@@ -0,0 +1,101 @@
+#ifndef V2495_STATS_H
+#define V2495_STATS_H
+
+#include <stdint.h> // for fixed-width integers
+#include <stdio.h>
+#include <chrono>
+
+// Counters and latency histograms of the V2495_flash register accesses and
+// waits, broken down by programming phase.
+//
+// The V2495_flash hot path is instrumented only when V2495_STATS is defined
+// at build time (e.g. make CPPFLAGS=-DV2495_STATS). Otherwise the STATS_*
+// macros below expand to nothing and the counters stay at zero.
+class V2495_stats
+{
+public:
+	typedef enum {
+		PHASE_OTHER = 0,
+		PHASE_LOAD,
+		PHASE_UNPROTECT,
+		PHASE_ERASE,
+		PHASE_PROGRAM,
+		PHASE_VERIFY,
+		PHASE_PROTECT,
+		PHASE_COUNT
+	} phase_t;
+
+	// wait_controller and wait_flash include the register accesses they do
+	typedef enum {
+		OP_WRITE_REGISTER = 0,
+		OP_READ_REGISTER,
+		OP_MULTI_WRITE_REGISTER,
+		OP_MULTI_READ_REGISTER,
+		OP_BLOCK_READ_REGISTER,
+		OP_WAIT_CONTROLLER,
+		OP_WAIT_FLASH,
+		OP_COUNT
+	} op_t;
+
+	// Bucket 0: < 1 us, bucket i: [2^(i-1), 2^i) us, the last one is open
+	const static int HISTOGRAM_BUCKETS = 28;
+
+	typedef struct {
+		uint64_t calls;
+		uint64_t words;   // 32 bit words moved (register accesses)
+		uint64_t polls;   // status reads (waits)
+		uint64_t total_ns;
+		uint64_t histogram[HISTOGRAM_BUCKETS];
+	} op_stats_t;
+
+	typedef std::chrono::steady_clock::time_point timestamp_t;
+
+	V2495_stats();
+
+	// true if the library was built with V2495_STATS
+	static bool enabled();
+
+	void reset();
+	void set_phase(phase_t phase) { current_phase = phase; }
+	phase_t get_phase() const { return current_phase; }
+
+	static timestamp_t start() { return std::chrono::steady_clock::now(); }
+	void record(op_t op, uint32_t words, timestamp_t started);
+	void add_polls(op_t op, uint32_t polls) { ops[current_phase][op].polls += polls; }
+
+	// Sum of the counters of other (e.g. the other controller of the same board)
+	void merge(const V2495_stats& other);
+
+	const op_stats_t& get(phase_t phase, op_t op) const { return ops[phase][op]; }
+
+	static const char *phase_name(phase_t phase);
+	static const char *op_name(op_t op);
+
+	// Table with one line per phase and operation that was used
+	void print(FILE *out, const char *prefix = "") const;
+	// JSON object: {"<phase>": {"<op>": {counters, "histogram_us": {...}}}}
+	void write_json(FILE *out, const char *indent = "") const;
+
+private:
+	phase_t current_phase;
+	op_stats_t ops[PHASE_COUNT][OP_COUNT];
+
+	// Upper bound (us) of the histogram bucket holding the p-th percentile
+	static uint64_t percentile_us(const op_stats_t& s, double p);
+};
+
+#ifdef V2495_STATS
+#define STATS_PHASE(phase)              stats.set_phase(V2495_stats::phase)
+#define STATS_SET_PHASE(value)          stats.set_phase(value)
+#define STATS_START(timer)              V2495_stats::timestamp_t timer = V2495_stats::start()
+#define STATS_RECORD(op, words, timer)  stats.record(V2495_stats::op, words, timer)
+#define STATS_POLLS(op, polls)          stats.add_polls(V2495_stats::op, polls)
+#else
+#define STATS_PHASE(phase)
+#define STATS_SET_PHASE(value)
+#define STATS_START(timer)
+#define STATS_RECORD(op, words, timer)
+#define STATS_POLLS(op, polls)
+#endif
+
+#endif
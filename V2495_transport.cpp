@@ -0,0 +1,112 @@
+#include "V2495_transport.h"
+#include "cvUpgradeV2495.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int V2495_parse_target(const char *str, V2495_target_t *target) {
+	char type[32];
+	unsigned long link_num, conet_node, base;
+	char *end;
+	const char *p;
+
+	p = strchr(str, ':');
+	if (p == NULL || p == str || (size_t)(p - str) >= sizeof(type))
+		return 0;
+	memcpy(type, str, p - str);
+	type[p - str] = '\0';
+
+	if (strcmp(type, "usb") == 0)
+		target->link_type = CAENComm_USB;
+	else if (strcmp(type, "optical") == 0 || strcmp(type, "conet") == 0)
+		target->link_type = CAENComm_OpticalLink;
+	else {
+		unsigned long n = strtoul(type, &end, 0);
+		if (*end != '\0')
+			return 0;
+		target->link_type = (CAENComm_ConnectionType)n;
+	}
+
+	link_num = strtoul(p + 1, &end, 0);
+	if (*end != ':')
+		return 0;
+	conet_node = strtoul(end + 1, &end, 0);
+	if (*end != ':')
+		return 0;
+	base = strtoul(end + 1, &end, 0);
+	if (*end != '\0')
+		return 0;
+
+	target->link_num = (int)link_num;
+	target->conet_node = (int)conet_node;
+	target->vme_base_address = (uint32_t)base;
+	return 1;
+}
+
+void V2495_format_target(const V2495_target_t& target, char *buf, size_t size) {
+	const char *type;
+	char number[16];
+
+	switch (target.link_type) {
+	case CAENComm_USB:
+		type = "usb";
+		break;
+	case CAENComm_OpticalLink:
+		type = "optical";
+		break;
+	default:
+		snprintf(number, sizeof(number), "%d", (int)target.link_type);
+		type = number;
+		break;
+	}
+	snprintf(buf, size, "%s:%d:%d:0x%08X", type, target.link_num, target.conet_node, target.vme_base_address);
+}
+
+V2495_CAENComm_transport::V2495_CAENComm_transport(CAENComm_ConnectionType link_type, int link_num, int conet_node, uint32_t vme_base_address)
+{
+	int32_t ret;
+
+	handle = -1;
+
+	ret = CAENComm_OpenDevice(link_type, link_num, conet_node, vme_base_address, &handle);
+	if (ret != CAENComm_Success) {
+		fprintf(stderr, "Device open failed with CAENComm error %d.\n", ret);
+		throw cuhRetCode_Open;
+	}
+}
+
+V2495_CAENComm_transport::V2495_CAENComm_transport(const V2495_target_t& target)
+	: V2495_CAENComm_transport(target.link_type, target.link_num, target.conet_node, target.vme_base_address)
+{
+}
+
+V2495_CAENComm_transport::~V2495_CAENComm_transport()
+{
+	if (handle != -1)
+		CAENComm_CloseDevice(handle);
+}
+
+int32_t V2495_CAENComm_transport::Write32(uint32_t address, uint32_t data) {
+	return CAENComm_Write32(handle, address, data);
+}
+
+int32_t V2495_CAENComm_transport::Read32(uint32_t address, uint32_t *data) {
+	return CAENComm_Read32(handle, address, data);
+}
+
+int32_t V2495_CAENComm_transport::MultiWrite32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) {
+	return CAENComm_MultiWrite32(handle, addresses, count, datas, errs);
+}
+
+int32_t V2495_CAENComm_transport::MultiRead32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) {
+	return CAENComm_MultiRead32(handle, addresses, count, datas, errs);
+}
+
+int32_t V2495_CAENComm_transport::BLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) {
+	return CAENComm_BLTRead(handle, address, buf, size, nw);
+}
+
+int32_t V2495_CAENComm_transport::MBLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) {
+	return CAENComm_MBLTRead(handle, address, buf, size, nw);
+}
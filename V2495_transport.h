@@ -0,0 +1,67 @@
+#ifndef V2495_TRANSPORT_H
+#define V2495_TRANSPORT_H
+
+#include <stdint.h> // for fixed-width integers
+#include <stddef.h>
+#include "CAENComm.h"
+
+// Address of a board: CAENComm link and VME base address
+typedef struct {
+	CAENComm_ConnectionType link_type;
+	int link_num;
+	int conet_node;
+	uint32_t vme_base_address;
+} V2495_target_t;
+
+// Parse "<link_type>:<link_num>:<conet_node>:<vme_base_address>", where
+// link_type is usb, optical (or conet) or the numeric CAENComm_ConnectionType,
+// e.g. "usb:0:0:0x32100000". Returns 0 if the string is not valid.
+int V2495_parse_target(const char *str, V2495_target_t *target);
+
+// Format a target in the same form accepted by V2495_parse_target
+void V2495_format_target(const V2495_target_t& target, char *buf, size_t size);
+
+// Register access layer used by V2495_flash.
+// All methods return a CAENComm_ErrorCode value, so V2495_flash handles
+// errors in the same way whatever implementation is behind it.
+class V2495_transport
+{
+public:
+	virtual ~V2495_transport() {}
+
+	virtual int32_t Write32(uint32_t address, uint32_t data) = 0;
+	virtual int32_t Read32(uint32_t address, uint32_t *data) = 0;
+
+	virtual int32_t MultiWrite32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) = 0;
+	virtual int32_t MultiRead32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) = 0;
+
+	// Block transfers (32 bit BLT and 64 bit MBLT) from consecutive addresses.
+	// size is in bytes, *nw returns the number of 32 bit words read.
+	// Links that can't do block transfers return CAENComm_NotSupported.
+	virtual int32_t BLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) { *nw = 0; return CAENComm_NotSupported; }
+	virtual int32_t MBLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) { *nw = 0; return CAENComm_NotSupported; }
+};
+
+// Transport on a CAENComm device handle (real hardware)
+class V2495_CAENComm_transport : public V2495_transport
+{
+private:
+	int handle;
+
+public:
+	// Throws cuhRetCode_Open if the device can't be opened
+	V2495_CAENComm_transport(CAENComm_ConnectionType link_type, int link_num, int conet_node, uint32_t vme_base_address);
+	V2495_CAENComm_transport(const V2495_target_t& target);
+	~V2495_CAENComm_transport();
+
+	int32_t Write32(uint32_t address, uint32_t data);
+	int32_t Read32(uint32_t address, uint32_t *data);
+
+	int32_t MultiWrite32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs);
+	int32_t MultiRead32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs);
+
+	int32_t BLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw);
+	int32_t MBLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw);
+};
+
+#endif
@@ -0,0 +1,401 @@
+// benchV2495.cpp : flash programming benchmark.
+//
+// Times the V2495_flash operations against a board (CAENComm link) or
+// against the in-process controller model (V2495_sim) and writes the
+// results as JSON, so they can be compared between releases.
+#include "V2495_flash.h"
+#include "V2495_sim.h"
+#include "cvUpgradeV2495.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// Transport wrapper counting the register transactions of the link behind it
+class counting_transport : public V2495_transport
+{
+public:
+	uint64_t transactions;
+
+	counting_transport(V2495_transport *link) : transactions(0), link(link) {}
+
+	int32_t Write32(uint32_t address, uint32_t data) { transactions++; return link->Write32(address, data); }
+	int32_t Read32(uint32_t address, uint32_t *data) { transactions++; return link->Read32(address, data); }
+
+	int32_t MultiWrite32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) {
+		transactions++;
+		return link->MultiWrite32(addresses, count, datas, errs);
+	}
+	int32_t MultiRead32(uint32_t *addresses, int32_t count, uint32_t *datas, CAENComm_ErrorCode *errs) {
+		transactions++;
+		return link->MultiRead32(addresses, count, datas, errs);
+	}
+
+	int32_t BLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) { transactions++; return link->BLTRead(address, buf, size, nw); }
+	int32_t MBLTRead(uint32_t address, uint32_t *buf, int32_t size, int32_t *nw) { transactions++; return link->MBLTRead(address, buf, size, nw); }
+
+private:
+	V2495_transport *link;
+};
+
+// Samples of one benchmarked operation
+typedef struct {
+	std::string name;
+	std::vector<double> us;   // duration of each call
+	uint64_t bytes;           // bytes moved by all the calls
+	uint64_t transactions;    // register transactions of all the calls
+} bench_result_t;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static counting_transport *link_counter;
+static std::vector<bench_result_t> results;
+
+static bench_result_t *new_result(const char *name) {
+	bench_result_t r;
+
+	r.name = name;
+	r.bytes = 0;
+	r.transactions = 0;
+	results.push_back(r);
+	return &results.back();
+}
+
+// Time one call of an operation moving length bytes
+#define BENCH_CALL(result, length, call) do { \
+		uint64_t t0_ = link_counter->transactions; \
+		bench_clock::time_point start_ = bench_clock::now(); \
+		call; \
+		(result)->us.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start_).count()); \
+		(result)->transactions += link_counter->transactions - t0_; \
+		(result)->bytes += (length); \
+	} while (0)
+
+static double percentile(std::vector<double> v, double p) {
+	size_t i;
+
+	if (v.empty())
+		return 0;
+	std::sort(v.begin(), v.end());
+	i = (size_t)(p / 100.0 * (v.size() - 1) + 0.5);
+	return v[i];
+}
+
+static void write_json(FILE *out, const char *link, const char *controller, const V2495_flash::transfer_mode_t mode,
+                       bool batching, bool use_sim, const uint32_t *sim_times) {
+	static const char *mode_names[] = { "multi", "blt", "mblt" };
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"tool\": \"benchV2495\",\n");
+	fprintf(out, "  \"version\": \"%u.%u.%u\",\n", VER_MAJ, VER_MIN, VER_PATCH);
+	fprintf(out, "  \"link\": \"%s\",\n", link);
+	fprintf(out, "  \"controller\": \"%s\",\n", controller);
+	fprintf(out, "  \"transfer_mode\": \"%s\",\n", mode_names[mode]);
+	fprintf(out, "  \"command_batching\": %s,\n", batching ? "true" : "false");
+	if (use_sim) {
+		fprintf(out, "  \"sim\": {\"call_latency_us\": %u, \"word_latency_ns\": %u, \"page_program_us\": %u, "
+		             "\"sector_erase_us\": %u, \"read_page_us\": %u},\n",
+		        sim_times[0], sim_times[1], sim_times[2], sim_times[3], sim_times[4]);
+	}
+	fprintf(out, "  \"operations\": [");
+	for (size_t i = 0; i < results.size(); i++) {
+		const bench_result_t& r = results[i];
+		double total_us = 0;
+		double pages = (double)r.bytes / 256;
+
+		for (size_t j = 0; j < r.us.size(); j++)
+			total_us += r.us[j];
+
+		fprintf(out, "%s\n    {\"name\": \"%s\", \"count\": %u, \"bytes\": %llu, ", (i == 0) ? "" : ",",
+		        r.name.c_str(), (unsigned)r.us.size(), (unsigned long long)r.bytes);
+		fprintf(out, "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, ",
+		        r.us.empty() ? 0 : total_us / r.us.size(), percentile(r.us, 50), percentile(r.us, 90),
+		        percentile(r.us, 99), percentile(r.us, 100));
+		fprintf(out, "\"transactions_per_op\": %.2f, \"transactions_per_page\": %.2f, \"mb_per_s\": %.3f}",
+		        r.us.empty() ? 0 : (double)r.transactions / r.us.size(), (pages > 0) ? r.transactions / pages : 0,
+		        (total_us > 0) ? r.bytes / total_us : 0);
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+// Random image of the given number of sectors, for the firmware benchmarks on the model
+static int make_image(char *filename, int sectors) {
+	std::vector<uint8_t> data(sectors * 64 * 1024);
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(filename);
+	if (fd < 0)
+		return 0;
+	f = fdopen(fd, "wb");
+	if (f == NULL)
+		return 0;
+
+	srand(2495);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (uint8_t)rand();
+
+	fwrite(&data[0], 1, data.size(), f);
+	fclose(f);
+	return 1;
+}
+
+void printVersion(const char *pname) {
+	printf("%s version %u.%u.%u - build %u\n",
+			pname, VER_MAJ, VER_MIN, VER_PATCH, VER_BUILD);
+}
+
+int usage(const char *pname, int retcode) {
+	FILE *dest = (retcode == 0) ? stdout : stderr;
+	fprintf(dest, "Usage: %s [-h | -v] [options]\n", pname);
+	fprintf(dest, "  -h: show this message and exit\n");
+	fprintf(dest, "  -v: print version\n");
+	fprintf(dest, "  -t <link_type>:<link_num>:<conet_node>:<vme_base>: benchmark a board\n");
+	fprintf(dest, "     (default: the simulated controller). WARNING: the scratch sectors\n");
+	fprintf(dest, "     are erased, and with -f the application firmware is reprogrammed.\n");
+	fprintf(dest, "  -c main|user: flash controller (default main)\n");
+	fprintf(dest, "  -a <address>: first scratch sector for the page/sector benchmarks\n");
+	fprintf(dest, "     (default 0x1000000 main, 0x1CA0000 user)\n");
+	fprintf(dest, "  -n <sectors>: scratch sectors to use (default 4)\n");
+	fprintf(dest, "  -f <firmware_file>: image for program_firmware/verify_firmware. With\n");
+	fprintf(dest, "     the simulated controller a random image of 8 sectors is used by default.\n");
+	fprintf(dest, "  -r <count>: program_firmware/verify_firmware repetitions (default 1)\n");
+	fprintf(dest, "  -b <mode>: flash readback transfer mode: multi, blt (default), mblt\n");
+	fprintf(dest, "  -s: single register writes (no command batching)\n");
+	fprintf(dest, "  -o <file>: JSON report (default benchV2495.json, - for stdout)\n");
+	fprintf(dest, "SIMULATED CONTROLLER LATENCY:\n");
+	fprintf(dest, "  -L <us>: register transaction (default 50)\n");
+	fprintf(dest, "  -W <ns>: each 32 bit word moved (default 100)\n");
+	fprintf(dest, "  -P <us>: page program (default 400)\n");
+	fprintf(dest, "  -E <us>: sector erase (default 150000)\n");
+	fprintf(dest, "  -R <us>: controller read page (default 10)\n");
+
+	return retcode;
+}
+
+int main(int argc, char *argv[])
+{
+	int32_t ret = cuhRetCode_Success;
+	const char *progname = basename(argv[0]);
+	int c;
+	bool use_sim = true;
+	V2495_target_t target;
+	V2495_flash::controller_t controller = V2495_flash::MAIN_CONTROLLER_OFFSET;
+	uint32_t scratch_address = 0;
+	int scratch_sectors = 4;
+	char *fwfile = NULL;
+	char tmpname[] = "/tmp/benchV2495_XXXXXX";
+	bool tmpimage = false;
+	int repeat = 1;
+	V2495_flash::transfer_mode_t transfer_mode = V2495_flash::TRANSFER_BLT;
+	bool batching = true;
+	const char *outfile = "benchV2495.json";
+	// call latency, word latency, page program, sector erase, read page
+	uint32_t sim_times[5] = { 50, 100, 400, 150000, 10 };
+	char link[64];
+
+	while ((c = getopt (argc, argv, "a:b:c:E:f:hL:n:o:P:r:R:st:vW:")) != -1)
+	switch (c)
+	{
+	case 'a':
+		scratch_address = strtoul(optarg, NULL, 0);
+		break;
+	case 'b':
+		if (strcmp(optarg, "multi") == 0)
+			transfer_mode = V2495_flash::TRANSFER_MULTIREAD;
+		else if (strcmp(optarg, "blt") == 0)
+			transfer_mode = V2495_flash::TRANSFER_BLT;
+		else if (strcmp(optarg, "mblt") == 0)
+			transfer_mode = V2495_flash::TRANSFER_MBLT;
+		else {
+			fprintf(stderr, "Unknown transfer mode %s.\n", optarg);
+			return usage(progname, cuhRetCode_Usage);
+		}
+		break;
+	case 'c':
+		if (strcmp(optarg, "main") == 0)
+			controller = V2495_flash::MAIN_CONTROLLER_OFFSET;
+		else if (strcmp(optarg, "user") == 0)
+			controller = V2495_flash::USER_CONTROLLER_OFFSET;
+		else {
+			fprintf(stderr, "Unknown controller %s.\n", optarg);
+			return usage(progname, cuhRetCode_Usage);
+		}
+		break;
+	case 'E':
+		sim_times[3] = strtoul(optarg, NULL, 0);
+		break;
+	case 'f':
+		fwfile = optarg;
+		break;
+	case 'h':
+		return usage(progname, cuhRetCode_Success);
+	case 'L':
+		sim_times[0] = strtoul(optarg, NULL, 0);
+		break;
+	case 'n':
+		scratch_sectors = atoi(optarg);
+		break;
+	case 'o':
+		outfile = optarg;
+		break;
+	case 'P':
+		sim_times[2] = strtoul(optarg, NULL, 0);
+		break;
+	case 'r':
+		repeat = atoi(optarg);
+		break;
+	case 'R':
+		sim_times[4] = strtoul(optarg, NULL, 0);
+		break;
+	case 's':
+		batching = false;
+		break;
+	case 't':
+		if (!V2495_parse_target(optarg, &target)) {
+			fprintf(stderr, "Invalid target %s.\n", optarg);
+			return usage(progname, cuhRetCode_Usage);
+		}
+		use_sim = false;
+		break;
+	case 'v':
+		printVersion(progname);
+		return 0;
+	case 'W':
+		sim_times[1] = strtoul(optarg, NULL, 0);
+		break;
+	default:
+		return usage(progname, cuhRetCode_Usage);
+	}
+
+	if (scratch_sectors < 1) {
+		fprintf(stderr, "At least one scratch sector is needed.\n");
+		return usage(progname, cuhRetCode_Usage);
+	}
+	if (scratch_address == 0)
+		scratch_address = (controller == V2495_flash::MAIN_CONTROLLER_OFFSET) ? 0x1000000 : 0x1CA0000;
+	scratch_address &= ~(uint32_t)(64 * 1024 - 1);
+
+	V2495_sim* sim = NULL;
+	V2495_transport* board = NULL;
+	V2495_flash* flash = NULL;
+
+	try {
+		if (use_sim) {
+			sim = new V2495_sim();
+			sim->set_call_latency(sim_times[0]);
+			sim->set_word_latency(sim_times[1]);
+			sim->set_page_program_time(sim_times[2]);
+			sim->set_sector_erase_time(sim_times[3]);
+			sim->set_read_page_time(sim_times[4]);
+			board = sim;
+			snprintf(link, sizeof(link), "sim");
+
+			if (fwfile == NULL) {
+				if (!make_image(tmpname, 8)) {
+					fprintf(stderr, "Error creating file %s\n", tmpname);
+					throw cuhRetCode_FileOpen;
+				}
+				fwfile = tmpname;
+				tmpimage = true;
+			}
+		}
+		else {
+			board = new V2495_CAENComm_transport(target);
+			V2495_format_target(target, link, sizeof(link));
+		}
+
+		link_counter = new counting_transport(board);
+		flash = new V2495_flash(controller, link_counter);
+		flash->set_transfer_mode(transfer_mode);
+		flash->set_command_batching(batching);
+
+		std::vector<uint8_t> page(256);
+		std::vector<uint8_t> sector(64 * 1024);
+		bench_result_t *r;
+
+		for (size_t i = 0; i < sector.size(); i++)
+			sector[i] = (uint8_t)(i * 7 + (i >> 8));
+
+		r = new_result("sector_erase");
+		for (int s = 0; s < scratch_sectors; s++)
+			BENCH_CALL(r, 64 * 1024, flash->sector_erase(scratch_address + s * 64 * 1024));
+
+		r = new_result("write_page");
+		for (int s = 0; s < scratch_sectors; s++) {
+			for (int p = 0; p < 256; p++)
+				BENCH_CALL(r, 256, flash->write_page(scratch_address + s * 64 * 1024 + p * 256, &sector[p * 256]));
+		}
+
+		r = new_result("read_page");
+		for (int s = 0; s < scratch_sectors; s++) {
+			for (int p = 0; p < 256; p++)
+				BENCH_CALL(r, 256, flash->read_page(scratch_address + s * 64 * 1024 + p * 256, &page[0]));
+		}
+
+		r = new_result("read_sector");
+		for (int s = 0; s < scratch_sectors; s++)
+			BENCH_CALL(r, 64 * 1024, flash->read_sector(scratch_address + s * 64 * 1024, &sector[0]));
+
+		r = new_result("write_sector");
+		for (int s = 0; s < scratch_sectors; s++) {
+			flash->sector_erase(scratch_address + s * 64 * 1024);
+			BENCH_CALL(r, 64 * 1024, flash->write_sector(scratch_address + s * 64 * 1024, &sector[0]));
+		}
+
+		if (fwfile != NULL) {
+			FILE *f = fopen(fwfile, "rb");
+			uint64_t size;
+
+			if (f == NULL) {
+				fprintf(stderr, "Error opening file %s\n", fwfile);
+				throw cuhRetCode_FileOpen;
+			}
+			fseek(f, 0, SEEK_END);
+			size = ftell(f);
+			fclose(f);
+
+			r = new_result("program_firmware");
+			for (int i = 0; i < repeat; i++)
+				BENCH_CALL(r, size, flash->program_firmware(V2495_flash::APPLICATION1_FW_REGION, fwfile));
+
+			r = new_result("verify_firmware");
+			for (int i = 0; i < repeat; i++)
+				BENCH_CALL(r, size, flash->verify_firmware(V2495_flash::APPLICATION1_FW_REGION, fwfile));
+		}
+	}
+	catch (cuhRetCode_t err) {
+		fprintf(stderr, "Benchmark failed with error %d\n", err);
+		ret = err;
+	}
+
+	if (flash != NULL)
+		delete flash;
+	if (link_counter != NULL)
+		delete link_counter;
+	if (board != NULL)
+		delete board;
+	if (tmpimage)
+		unlink(tmpname);
+
+	if (ret == cuhRetCode_Success) {
+		FILE *out = (strcmp(outfile, "-") == 0) ? stdout : fopen(outfile, "w");
+
+		if (out == NULL) {
+			fprintf(stderr, "Error opening file %s\n", outfile);
+			return cuhRetCode_FileOpen;
+		}
+		write_json(out, link, (controller == V2495_flash::MAIN_CONTROLLER_OFFSET) ? "main" : "user",
+		           transfer_mode, batching, use_sim, sim_times);
+		if (out != stdout)
+			fclose(out);
+	}
+
+	return ret;
+}
@@ -1,26 +1,558 @@
 // firmware_upgrade.cpp : Defines the entry point for the console application.
 //
+#include "V2495_config_rom.h"
 #include "V2495_flash.h"
+#include "V2495_slots.h"
 #include "cvUpgradeV2495.h"
 
 #include <unistd.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libgen.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// Long options without a short equivalent
+#define OPT_RESUME 256
+#define OPT_REPAIR 257
+#define OPT_HEALTH 258
+#define OPT_CONFIG_ROM 259
+
+// An operation of a batch manifest
+typedef enum {MANIFEST_PROGRAM, MANIFEST_VERIFY, MANIFEST_REPAIR, MANIFEST_ERASE, MANIFEST_DUMP} manifest_command_t;
+
+typedef struct {
+	manifest_command_t command;
+	int user; // controller: 0 main, 1 user
+	V2495_flash::fw_region_t region;
+	std::string file; // image, or output file of a dump
+	int line;         // in the manifest
+} manifest_op_t;
+
+// Programming options, common to all the boards
+typedef struct {
+	char *fwfile;
+	char *user_fwfile; // NULL: main controller only
+	bool activate; // switch the user FPGA to user_fwfile (see V2495_slots)
+	bool reboot;   // configure the user FPGA from reboot_region
+	bool check;    // only tell whether the images are already on the board
+	V2495_flash::fw_region_t reboot_region;
+	bool health;   // user FPGA health check set (needed by activate and reboot)
+	uint32_t health_address;
+	uint32_t health_mask;
+	uint32_t health_value;
+	std::vector<V2495_flash::fw_region_t> user_slots; // regions for user_fwfile, empty: application 1 only
+	bool differential;
+	bool single_writes;
+	V2495_flash::transfer_mode_t transfer_mode;
+	const char *journal_dir;
+	bool resume;
+	bool repair; // rewrite only the damaged sectors
+	int retries;
+	const std::vector<manifest_op_t> *manifest; // batch mode, NULL otherwise
+} upgrade_options_t;
+
+// A board to upgrade and its outcome
+typedef struct {
+	V2495_target_t target;
+	char name[64];
+	int32_t ret;
+	double seconds;
+	int retries; // failed transactions or commands sent again
+	V2495_stats stats; // both controllers
+} board_job_t;
 
 void printVersion(const char *pname) {
 	printf("%s version %u.%u.%u - build %u\n",
 			pname, VER_MAJ, VER_MIN, VER_PATCH, VER_BUILD);
 }
 
+// Journal file of a controller of a board: <dir>/v2495_<board>_<controller>.journal
+// Board name usable in a file name
+static void board_file_name(char *name, size_t size, const board_job_t *job) {
+	snprintf(name, size, "%s", job->name);
+	for (char *p = name; *p != '\0'; p++) {
+		if (*p == ':')
+			*p = '_';
+	}
+}
+
+void journal_path(char *path, size_t size, const upgrade_options_t *opts, const board_job_t *job, const char *controller) {
+	char name[64];
+
+	board_file_name(name, sizeof(name), job);
+	snprintf(path, size, "%s/v2495_%s_%s.journal", opts->journal_dir, name, controller);
+}
+
+// Shadow of both controllers of the board, next to the journals. The
+// board has no serial number readable through the flash controllers, so
+// the shadow is keyed by the target string. A different board at the
+// same target is caught by the pages read back, like any other write the
+// shadow didn't see.
+void shadow_path(char *path, size_t size, const upgrade_options_t *opts, const board_job_t *job) {
+	char name[64];
+
+	board_file_name(name, sizeof(name), job);
+	snprintf(path, size, "%s/v2495_%s.shadow", opts->journal_dir, name);
+}
+
+// Quick check of an application image (see V2495_flash::quick_check). The
+// whole image is read back only if the shadow doesn't know the region.
+static bool image_up_to_date(V2495_flash *flash, char *filename, const char *prefix) {
+	switch (flash->quick_check(V2495_flash::APPLICATION1_FW_REGION, filename)) {
+	case V2495_flash::QUICK_CHECK_UP_TO_DATE:
+		return true;
+	case V2495_flash::QUICK_CHECK_OUTDATED:
+		return false;
+	default:
+		break;
+	}
+
+	printf("%sVerifying the whole image from file %s....\n", prefix, filename);
+	try {
+		flash->verify_firmware(V2495_flash::APPLICATION1_FW_REGION, filename);
+	}
+	catch (cuhRetCode_t err) {
+		if (err != cuhRetCode_InvalidFirmware)
+			throw;
+		return false;
+	}
+	return true;
+}
+
+// Configuration ROM mode: "get <offset> <length>" prints the bytes in hex,
+// "set <offset> <hex bytes>" writes them (see V2495_config_rom::commit).
+int config_rom_command(V2495_flash *flash, const char *command, uint32_t offset, const char *argument) {
+	V2495_config_rom rom(*flash);
+	std::vector<uint8_t> bytes;
+
+	if (strcmp(command, "get") == 0) {
+		uint32_t length = strtoul(argument, NULL, 0);
+
+		if (length == 0)
+			return cuhRetCode_Usage;
+		bytes.resize(length);
+		rom.read(offset, &bytes[0], length);
+		for (uint32_t i = 0; i < length; i++)
+			printf("%02X%s", bytes[i], (i % 16 == 15 || i + 1 == length) ? "\n" : " ");
+		return cuhRetCode_Success;
+	}
+
+	if (strcmp(command, "set") != 0)
+		return cuhRetCode_Usage;
+
+	for (const char *p = argument; *p != '\0'; p += 2) {
+		char byte[3] = { p[0], p[1], '\0' };
+		char *end;
+
+		if (p[1] == '\0')
+			return cuhRetCode_Usage;
+		bytes.push_back((uint8_t)strtoul(byte, &end, 16));
+		if (*end != '\0')
+			return cuhRetCode_Usage;
+	}
+	if (bytes.empty())
+		return cuhRetCode_Usage;
+
+	rom.write(offset, &bytes[0], (uint32_t)bytes.size());
+	printf("Writing %u byte(s) of the configuration ROM at offset 0x%04X.\n", (uint32_t)bytes.size(), offset);
+	rom.commit();
+	return cuhRetCode_Success;
+}
+
+static const char *manifest_commands[] = { "program", "verify", "repair", "erase", "dump" };
+
+// Manifest: one operation per line, "<command> <main|user> <region> [<file>]".
+// Empty lines and text after # are ignored.
+int load_manifest(const char *filename, std::vector<manifest_op_t>& ops) {
+	FILE *in = fopen(filename, "r");
+	char line[1024];
+	int number = 0;
+
+	if (in == NULL) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return cuhRetCode_FileOpen;
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char command[32], controller[32], region[32], file[1024];
+		manifest_op_t op;
+		int fields, c;
+
+		number++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		fields = sscanf(line, "%31s %31s %31s %1023s", command, controller, region, file);
+		if (fields <= 0)
+			continue;
+
+		for (c = MANIFEST_PROGRAM; c <= MANIFEST_DUMP; c++) {
+			if (strcmp(command, manifest_commands[c]) == 0)
+				break;
+		}
+		op.command = (manifest_command_t)c;
+		op.user = (fields > 1 && strcmp(controller, "user") == 0);
+		op.line = number;
+
+		if (c > MANIFEST_DUMP || fields < 3 || (!op.user && strcmp(controller, "main") != 0) ||
+		    !V2495_flash::parse_region(region, &op.region) || (fields < 4 && op.command != MANIFEST_ERASE)) {
+			fprintf(stderr, "%s:%d: invalid operation \"%s\".\n", filename, number, line);
+			fclose(in);
+			return cuhRetCode_InvalidFile;
+		}
+		if (fields == 4)
+			op.file = file;
+		ops.push_back(op);
+	}
+	fclose(in);
+
+	if (ops.empty()) {
+		fprintf(stderr, "No operations in %s.\n", filename);
+		return cuhRetCode_InvalidFile;
+	}
+	return cuhRetCode_Success;
+}
+
+static bool manifest_order(const manifest_op_t& a, const manifest_op_t& b) {
+	if (a.user != b.user)
+		return a.user < b.user;
+	return a.region < b.region;
+}
+
+// Group the operations by controller and region, boot region first.
+// The order of the operations on the same region is kept, so the boot
+// sectors are unprotected and protected once per controller, and
+// operations using the same image one after the other load it once.
+void schedule_manifest(std::vector<manifest_op_t>& ops) {
+	std::stable_sort(ops.begin(), ops.end(), manifest_order);
+}
+
+static bool manifest_writes(const manifest_op_t& op) {
+	return op.command == MANIFEST_PROGRAM || op.command == MANIFEST_REPAIR || op.command == MANIFEST_ERASE;
+}
+
+void run_manifest(const std::vector<manifest_op_t>& ops, V2495_flash *flash[2], const char *prefix) {
+	int boot_unprotected[2] = { 0, 0 };
+
+	for (size_t i = 0; i < ops.size(); i++) {
+		const manifest_op_t& op = ops[i];
+		V2495_flash *f = flash[op.user];
+		char *file = const_cast<char *>(op.file.c_str());
+
+		printf("%s%s %s %s%s%s\n", prefix, manifest_commands[op.command], op.user ? "user" : "main",
+		       V2495_flash::region_name(op.region), op.file.empty() ? "" : " ", file);
+
+		try {
+			if (op.region == V2495_flash::BOOT_FW_REGION && manifest_writes(op) && !boot_unprotected[op.user]) {
+				f->begin_boot_update();
+				boot_unprotected[op.user] = 1;
+			}
+
+			switch (op.command) {
+			case MANIFEST_PROGRAM:
+				f->program_firmware(op.region, file);
+				break;
+			case MANIFEST_VERIFY:
+				f->verify_firmware(op.region, file);
+				break;
+			case MANIFEST_REPAIR:
+				f->repair_firmware(op.region, file);
+				break;
+			case MANIFEST_ERASE:
+				f->erase_firmware(op.region);
+				break;
+			case MANIFEST_DUMP:
+				f->dump_firmware(op.region, file);
+				break;
+			}
+
+			// Last operation on the boot region of this controller
+			if (boot_unprotected[op.user] &&
+			    (i + 1 == ops.size() || ops[i + 1].user != op.user || ops[i + 1].region != V2495_flash::BOOT_FW_REGION)) {
+				f->end_boot_update();
+				boot_unprotected[op.user] = 0;
+			}
+		}
+		catch (cuhRetCode_t err) {
+			fprintf(stderr, "%sOperation at line %d failed with error %d\n", prefix, op.line, err);
+			if (boot_unprotected[op.user]) {
+				try {
+					f->end_boot_update();
+				}
+				catch (cuhRetCode_t protect_err) {
+					fprintf(stderr, "%sError %d protecting the boot sectors again\n", prefix, protect_err);
+				}
+			}
+			throw;
+		}
+	}
+}
+
+static bool manifest_uses_user(const upgrade_options_t *opts) {
+	if (opts->manifest == NULL)
+		return false;
+	for (size_t i = 0; i < opts->manifest->size(); i++) {
+		if ((*opts->manifest)[i].user)
+			return true;
+	}
+	return false;
+}
+
+void upgrade_board(board_job_t *job, const upgrade_options_t *opts, bool log_prefix) {
+	V2495_transport* transport = NULL;
+	V2495_flash* main_flash = NULL;
+	V2495_flash* user_flash = NULL;
+	char prefix[80];
+	char journal[512];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	snprintf(prefix, sizeof(prefix), "[%s] ", job->name);
+	if (!log_prefix)
+		prefix[0] = '\0';
+
+	job->ret = cuhRetCode_Success;
+	job->retries = 0;
+
+	try {
+		// Both controllers share the same link
+		transport = new V2495_CAENComm_transport(job->target);
+
+		// The main FPGA is left configured when only the user one is switched
+		if (!opts->activate && !opts->reboot) {
+			main_flash = new V2495_flash(V2495_flash::MAIN_CONTROLLER_OFFSET, transport); // Main flash controller
+			main_flash->set_log_prefix(prefix);
+			main_flash->set_differential_mode(opts->differential);
+			main_flash->set_transfer_mode(opts->transfer_mode);
+			main_flash->set_command_batching(!opts->single_writes);
+			main_flash->set_retries(opts->retries);
+			journal_path(journal, sizeof(journal), opts, job, "main");
+			main_flash->set_journal(journal, job->name, opts->resume);
+			shadow_path(journal, sizeof(journal), opts, job);
+			main_flash->set_shadow(journal, job->name);
+		}
+
+		if (opts->user_fwfile != NULL || manifest_uses_user(opts) || opts->reboot) {
+			char user_prefix[96];
+
+			snprintf(user_prefix, sizeof(user_prefix), "%s(user) ", prefix);
+
+			user_flash = new V2495_flash(V2495_flash::USER_CONTROLLER_OFFSET, transport); // User flash controller
+			user_flash->set_log_prefix(user_prefix);
+			user_flash->set_differential_mode(opts->differential);
+			user_flash->set_transfer_mode(opts->transfer_mode);
+			user_flash->set_command_batching(!opts->single_writes);
+			user_flash->set_retries(opts->retries);
+			journal_path(journal, sizeof(journal), opts, job, "user");
+			user_flash->set_journal(journal, job->name, opts->resume);
+			shadow_path(journal, sizeof(journal), opts, job);
+			user_flash->set_shadow(journal, job->name);
+			if (opts->health)
+				user_flash->set_health_check(opts->health_address, opts->health_mask, opts->health_value);
+		}
+
+		if (opts->reboot) {
+			// *************************************
+			// User FPGA reboot, back to the previous
+			// image if the new one doesn't come up
+			// *************************************
+			user_flash->reboot_with_rollback(opts->reboot_region);
+		}
+		else if (opts->activate) {
+			// *************************************
+			// User image switch: reboot from the slot
+			// holding it, programming it if needed
+			// *************************************
+			V2495_slots slots(*user_flash);
+
+			printf("%sActivating V2495 user firmware image from file %s....\n", prefix, opts->user_fwfile);
+			slots.activate(opts->user_fwfile);
+		}
+		else if (opts->check) {
+			// *************************************
+			// Quick check: is an upgrade needed?
+			// Nothing is written, but the FPGAs were
+			// deconfigured to read the flash (see
+			// V2495_flash::acquire_flash_access)
+			// *************************************
+			bool up_to_date = image_up_to_date(main_flash, opts->fwfile, prefix);
+
+			if (up_to_date && user_flash != NULL)
+				up_to_date = image_up_to_date(user_flash, opts->user_fwfile, prefix);
+
+			printf("%s%s\n", prefix, up_to_date ? "Firmware up to date." : "Firmware upgrade needed.");
+			if (!up_to_date)
+				job->ret = cuhRetCode_InvalidFirmware;
+		}
+		else if (opts->manifest != NULL) {
+			// *************************************
+			// Batch: all the operations of the
+			// manifest in this session
+			// *************************************
+			V2495_flash *flash[2] = { main_flash, user_flash };
+
+			run_manifest(*opts->manifest, flash, prefix);
+		}
+		else if (opts->repair) {
+			// *************************************
+			// Repair: only the damaged sectors are
+			// programmed again, one flash at a time
+			// *************************************
+			printf("%sRepairing V2495 application firmware image from file %s....\n", prefix, opts->fwfile);
+			main_flash->repair_firmware(V2495_flash::APPLICATION1_FW_REGION, opts->fwfile);
+			if (user_flash != NULL) {
+				printf("%sRepairing V2495 user firmware image from file %s....\n", prefix, opts->user_fwfile);
+				user_flash->repair_firmware(V2495_flash::APPLICATION1_FW_REGION, opts->user_fwfile);
+			}
+		}
+		else if (user_flash != NULL && !opts->user_slots.empty()) {
+			// *************************************
+			// Application programming, then the user
+			// image in several slots (loaded once)
+			// *************************************
+			printf("%sUpgrading V2495 application firmware image from file %s....\n", prefix, opts->fwfile);
+			main_flash->program_firmware(V2495_flash::APPLICATION1_FW_REGION, opts->fwfile);
+			printf("%sUpgrading %d V2495 user firmware slots from file %s....\n", prefix, (int)opts->user_slots.size(), opts->user_fwfile);
+			user_flash->program_firmware_slots(opts->user_slots, opts->user_fwfile);
+		}
+		else if (user_flash == NULL) {
+			// *************************************
+			// Application programming 
+			// *************************************
+			printf("%sUpgrading V2495 application firmware image from file %s....\n", prefix, opts->fwfile);
+			main_flash->program_firmware(V2495_flash::APPLICATION1_FW_REGION, opts->fwfile);
+		}
+		else {
+			// *************************************
+			// Application programming, main and user
+			// flash at the same time
+			// *************************************
+			printf("%sUpgrading V2495 application firmware image from file %s and user firmware image from file %s....\n",
+			       prefix, opts->fwfile, opts->user_fwfile);
+			V2495_flash::program_firmware_interleaved(*main_flash, V2495_flash::APPLICATION1_FW_REGION, opts->fwfile,
+			                                          *user_flash, V2495_flash::APPLICATION1_FW_REGION, opts->user_fwfile);
+		}
+	}
+	catch (cuhRetCode_t err) {
+		fprintf(stderr, "%sFirmware upgrade failed with error %d\n", prefix, err);
+		job->ret = err;
+	}
+
+	if (user_flash != NULL) {
+		job->retries += user_flash->get_retries();
+		job->stats.merge(user_flash->get_stats());
+		delete user_flash;
+	}
+	if (main_flash != NULL) {
+		job->retries += main_flash->get_retries();
+		job->stats.merge(main_flash->get_stats());
+		delete main_flash;
+	}
+	if (transport != NULL)
+		delete transport;
+
+	if (job->retries > 0)
+		printf("%s%d failed transactions were retried.\n", prefix, job->retries);
+
+	job->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Boards behind the same link are upgraded one after the other
+void link_worker(std::vector<board_job_t *> jobs, const upgrade_options_t *opts, bool log_prefix) {
+	for (size_t i = 0; i < jobs.size(); i++)
+		upgrade_board(jobs[i], opts, log_prefix);
+}
+
+// Statistics of all the boards as JSON
+int write_stats_json(const char *filename, const std::vector<board_job_t>& boards) {
+	FILE *out = fopen(filename, "w");
+
+	if (out == NULL) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return cuhRetCode_FileOpen;
+	}
+
+	fprintf(out, "{\n  \"instrumentation\": %s,\n  \"boards\": {", V2495_stats::enabled() ? "true" : "false");
+	for (size_t i = 0; i < boards.size(); i++) {
+		fprintf(out, "%s\n    \"%s\": ", (i == 0) ? "" : ",", boards[i].name);
+		boards[i].stats.write_json(out, "    ");
+	}
+	fprintf(out, "\n  }\n}\n");
+	fclose(out);
+	return cuhRetCode_Success;
+}
+
 int usage(const char *pname, int retcode) {
 	FILE *dest = (retcode == 0) ? stdout : stderr;
 	fprintf(dest, "Usage: %s [[-h | -v] | [-f]] [options] <arguments>\n", pname);
 	fprintf(dest, "  -h: show this message and exit\n");
 	fprintf(dest, "  -v: print version\n");
 	fprintf(dest, "  -f: firmware update mode (default)\n");
-	fprintf(dest, "FIRMWARE UPDATE MODE ARGUMENTS:\n");
+	fprintf(dest, "  -r: dump mode: read the application firmware back to a file\n");
+	fprintf(dest, "  -c: check mode: tell whether the board already holds the firmware\n");
+	fprintf(dest, "     (and user firmware, -u) images, exit code 0 if it does. The images\n");
+	fprintf(dest, "     are compared with the shadow of the board (the sector hashes of what\n");
+	fprintf(dest, "     was last programmed, kept next to the journals) and a few random\n");
+	fprintf(dest, "     pages are read back; the whole image only if the shadow has no record.\n");
+	fprintf(dest, "     Reading the flash takes it from the FPGAs: they are deconfigured\n");
+	fprintf(dest, "     during the check and restarted at the end, as in the other modes.\n");
+	fprintf(dest, "     The shadow belongs to the -t target, not to the board in it: a\n");
+	fprintf(dest, "     swapped board is only caught by the pages read back.\n");
+	fprintf(dest, "  --config-rom: configuration ROM mode: read or write bytes of the\n");
+	fprintf(dest, "     configuration ROM sector of the main flash\n");
+	fprintf(dest, "  -m <manifest>: batch mode: run the operations listed in manifest\n");
+	fprintf(dest, "  -d: differential programming: rewrite only the sectors that changed\n");
+	fprintf(dest, "  -s: single register writes (no command batching)\n");
+	fprintf(dest, "  -b <mode>: flash readback transfer mode: multi, blt (default), mblt\n");
+	fprintf(dest, "  -u <user_firmware_file>: also upgrade the user FPGA application firmware,\n");
+	fprintf(dest, "     programming main and user flash at the same time\n");
+	fprintf(dest, "  -U <slots>: with -u, program the user image in these user application\n");
+	fprintf(dest, "     slots, comma separated (e.g. 1,3,5), erasing all of them first and\n");
+	fprintf(dest, "     verifying each one\n");
+	fprintf(dest, "  -a <user_firmware_file>: activate mode: configure the user FPGA with\n");
+	fprintf(dest, "     this image, rebooting from the user application slot that holds it\n");
+	fprintf(dest, "     or programming it first in the least recently used slot\n");
+	fprintf(dest, "  -R <region>: reboot mode: configure the user FPGA from region (boot,\n");
+	fprintf(dest, "     app1 ... app5), going back to the previous one if it doesn't pass\n");
+	fprintf(dest, "     the health check\n");
+	fprintf(dest, "  --health <address>:<mask>:<value>: user FPGA health check after a\n");
+	fprintf(dest, "     reboot, required by -a and -R: register at address (hex, from the\n");
+	fprintf(dest, "     board base) under mask equal to value. Use a register of the user\n");
+	fprintf(dest, "     FPGA design that tells the application is running: the check must\n");
+	fprintf(dest, "     fail while the FPGA configures and pass again when the new image\n");
+	fprintf(dest, "     is up (the flash controller registers, e.g. IDCODE, never go down)\n");
+	fprintf(dest, "  -n <count>: retries of a failed transaction before giving up (default 5)\n");
+	fprintf(dest, "  --resume: continue an interrupted upgrade from its journal\n");
+	fprintf(dest, "  --repair: check the whole image, rewrite only the damaged sectors and\n");
+	fprintf(dest, "     verify them\n");
+	fprintf(dest, "  -J <dir>: directory of the progress journals and of the shadows (default .)\n");
+	fprintf(dest, "  -j <file>: write the register access statistics as JSON (instrumented\n");
+	fprintf(dest, "     builds only, see V2495_STATS)\n");
+	fprintf(dest, "  -t <link_type>:<link_num>:<conet_node>:<vme_base>: board to upgrade\n");
+	fprintf(dest, "     (default usb:0:0:0). Repeat -t to upgrade several boards: boards on\n");
+	fprintf(dest, "     different links are upgraded in parallel. link_type is usb, optical\n");
+	fprintf(dest, "     or the numeric CAENComm connection type.\n");
+	fprintf(dest, "FIRMWARE UPDATE AND CHECK MODE ARGUMENTS:\n");
 	fprintf(dest, "  <arguments> = <firmware_file>\n\n");
+	fprintf(dest, "DUMP MODE ARGUMENTS:\n");
+	fprintf(dest, "  <arguments> = <output_file> [<offset> [<length>]]\n");
+	fprintf(dest, "  (offset and length in bytes from the start of the region, default whole region)\n\n");
+	fprintf(dest, "CONFIGURATION ROM MODE ARGUMENTS:\n");
+	fprintf(dest, "  <arguments> = get <offset> <length> | set <offset> <hex_bytes>\n");
+	fprintf(dest, "  (offset from the start of the sector; set erases the sector only if\n");
+	fprintf(dest, "  some bit goes from 0 to 1, e.g. set 0x10 0102A0FF)\n\n");
+	fprintf(dest, "ACTIVATE AND REBOOT MODE ARGUMENTS:\n");
+	fprintf(dest, "  <arguments> = NULL\n\n");
+	fprintf(dest, "BATCH MODE:\n");
+	fprintf(dest, "  one operation per line of the manifest (# starts a comment):\n");
+	fprintf(dest, "  <program|verify|repair|dump> <main|user> <region> <file>\n");
+	fprintf(dest, "  erase <main|user> <region>\n");
+	fprintf(dest, "  region is boot or app1 ... app5 (app2 ... app5 on the user controller\n");
+	fprintf(dest, "  only). Operations are grouped by controller and region, keeping their\n");
+	fprintf(dest, "  order within a region, and run in a single session for each board.\n\n");
 	fprintf(dest, "FLASH UPDATE MODE ARGUMENTS:\n");
 	fprintf(dest, "  <arguments> = NULL\n");
 
@@ -30,22 +562,129 @@ int usage(const char *pname, int retcode) {
 int main(int argc, char *argv[])
 {
 	int32_t ret = cuhRetCode_Success;
-	V2495_flash* main_flash = NULL;
 	workMode_t wm = workMode_FWUPDATE;
 	int32_t index, nargs;
 	const char *progname = basename(argv[0]);
 	int c;
 	bool opt_s = false;
 	bool opt_y = false;
+	bool opt_d = false;
+	char *user_fwfile = NULL;
+	char *stats_file = NULL;
+	char *manifest_file = NULL;
+	std::vector<V2495_flash::fw_region_t> user_slots;
+	std::vector<manifest_op_t> manifest;
+	const char *journal_dir = ".";
+	bool opt_resume = false;
+	bool opt_repair = false;
+	bool opt_health = false;
+	uint32_t health[3] = { 0, 0, 0 };
+	V2495_flash::fw_region_t reboot_region = V2495_flash::APPLICATION1_FW_REGION;
+	int retries = 5;
+	static struct option long_options[] = {
+		{"resume", no_argument, NULL, OPT_RESUME},
+		{"repair", no_argument, NULL, OPT_REPAIR},
+		{"health", required_argument, NULL, OPT_HEALTH},
+		{"config-rom", no_argument, NULL, OPT_CONFIG_ROM},
+		{NULL, 0, NULL, 0}
+	};
+	V2495_flash::transfer_mode_t transfer_mode = V2495_flash::TRANSFER_BLT;
+	std::vector<board_job_t> boards;
+	board_job_t board;
 
-	while ((c = getopt (argc, argv, "fhv")) != -1)
+	while ((c = getopt_long (argc, argv, "a:b:cdfhj:J:m:n:rR:st:u:U:v", long_options, NULL)) != -1)
 	switch (c)
 	{
+	case 'a':
+		wm = workMode_ACTIVATE;
+		user_fwfile = optarg;
+		break;
+	case 'b':
+		if (strcmp(optarg, "multi") == 0)
+			transfer_mode = V2495_flash::TRANSFER_MULTIREAD;
+		else if (strcmp(optarg, "blt") == 0)
+			transfer_mode = V2495_flash::TRANSFER_BLT;
+		else if (strcmp(optarg, "mblt") == 0)
+			transfer_mode = V2495_flash::TRANSFER_MBLT;
+		else {
+			fprintf(stderr, "Unknown transfer mode %s.\n", optarg);
+			return usage(progname, cuhRetCode_Usage);
+		}
+		break;
+	case 'c':
+		wm = workMode_CHECK;
+		break;
+	case 'd':
+		opt_d = true;
+		break;
 	case 'f':
 		wm = workMode_FWUPDATE;
 		break;
 	case 'h':
 		return usage(progname, cuhRetCode_Success);
+	case 'j':
+		stats_file = optarg;
+		break;
+	case 'J':
+		journal_dir = optarg;
+		break;
+	case 'm':
+		wm = workMode_BATCH;
+		manifest_file = optarg;
+		break;
+	case 'n':
+		retries = atoi(optarg);
+		break;
+	case OPT_RESUME:
+		opt_resume = true;
+		break;
+	case OPT_REPAIR:
+		opt_repair = true;
+		break;
+	case OPT_HEALTH:
+		if (sscanf(optarg, "%x:%x:%x", &health[0], &health[1], &health[2]) != 3) {
+			fprintf(stderr, "Invalid health check %s.\n", optarg);
+			return usage(progname, cuhRetCode_Usage);
+		}
+		opt_health = true;
+		break;
+	case OPT_CONFIG_ROM:
+		wm = workMode_CONFIG_ROM;
+		break;
+	case 'r':
+		wm = workMode_DUMP;
+		break;
+	case 'R':
+		if (!V2495_flash::parse_region(optarg, &reboot_region)) {
+			fprintf(stderr, "Unknown region %s.\n", optarg);
+			return usage(progname, cuhRetCode_Usage);
+		}
+		wm = workMode_REBOOT;
+		break;
+	case 's':
+		opt_s = true;
+		break;
+	case 't':
+		if (!V2495_parse_target(optarg, &board.target)) {
+			fprintf(stderr, "Invalid target %s.\n", optarg);
+			return usage(progname, cuhRetCode_Usage);
+		}
+		boards.push_back(board);
+		break;
+	case 'u':
+		user_fwfile = optarg;
+		break;
+	case 'U':
+		for (char *p = strtok(optarg, ","); p != NULL; p = strtok(NULL, ",")) {
+			int slot = atoi(p);
+
+			if (slot < 1 || slot > 5) {
+				fprintf(stderr, "Invalid user slot %s.\n", p);
+				return usage(progname, cuhRetCode_Usage);
+			}
+			user_slots.push_back((V2495_flash::fw_region_t)(V2495_flash::APPLICATION1_FW_REGION + slot - 1));
+		}
+		break;
 	case 'v':
 		printVersion(progname);
 		return 0;
@@ -67,33 +706,200 @@ int main(int argc, char *argv[])
 	index = optind;
 	nargs = argc - index;
 	
-	if (wm == workMode_FWUPDATE) {
-		char *fwfile;
+	if (wm == workMode_FWUPDATE || wm == workMode_BATCH || wm == workMode_ACTIVATE || wm == workMode_REBOOT || wm == workMode_CHECK) {
+		char *fwfile = NULL;
 		
-		if (nargs < 1) {
+		if (wm == workMode_BATCH) {
+			ret = load_manifest(manifest_file, manifest);
+			if (ret != cuhRetCode_Success)
+				return ret;
+			schedule_manifest(manifest);
+		}
+		else if (wm == workMode_ACTIVATE || wm == workMode_REBOOT) {
+			if (!user_slots.empty()) {
+				fprintf(stderr, "-U can't be used in activate or reboot mode.\n");
+				return usage(progname, cuhRetCode_Usage);
+			}
+			if (!opt_health) {
+				fprintf(stderr, "Activate and reboot mode need a health check (--health).\n");
+				return usage(progname, cuhRetCode_Usage);
+			}
+		}
+		else if (nargs < 1) {
 			fprintf(stderr, "Too few arguments for firmware update mode.\n");
 			return usage(progname, cuhRetCode_Usage);
 		}
-		fwfile = argv[index];
-		
+		else {
+			fwfile = argv[index];
+		}
+		if (!user_slots.empty() && user_fwfile == NULL) {
+			fprintf(stderr, "-U needs a user firmware file (-u).\n");
+			return usage(progname, cuhRetCode_Usage);
+		}
+
+		upgrade_options_t opts;
+		opts.fwfile = fwfile;
+		opts.user_fwfile = user_fwfile;
+		opts.activate = (wm == workMode_ACTIVATE);
+		opts.reboot = (wm == workMode_REBOOT);
+		opts.check = (wm == workMode_CHECK);
+		opts.reboot_region = reboot_region;
+		opts.health = opt_health;
+		opts.health_address = health[0];
+		opts.health_mask = health[1];
+		opts.health_value = health[2];
+		opts.user_slots = user_slots;
+		opts.differential = opt_d;
+		opts.single_writes = opt_s;
+		opts.transfer_mode = transfer_mode;
+		opts.journal_dir = journal_dir;
+		opts.resume = opt_resume;
+		opts.repair = opt_repair;
+		opts.retries = retries;
+		opts.manifest = (wm == workMode_BATCH) ? &manifest : NULL;
+
+		if (boards.empty()) {
+			V2495_parse_target("usb:0:0:0", &board.target);
+			boards.push_back(board);
+		}
+
+		// One worker per independent link (link type and number)
+		std::vector<std::vector<board_job_t *> > links;
+		for (size_t i = 0; i < boards.size(); i++) {
+			size_t l;
+
+			V2495_format_target(boards[i].target, boards[i].name, sizeof(boards[i].name));
+			for (l = 0; l < links.size(); l++) {
+				if (links[l][0]->target.link_type == boards[i].target.link_type &&
+				    links[l][0]->target.link_num == boards[i].target.link_num)
+					break;
+			}
+			if (l == links.size())
+				links.push_back(std::vector<board_job_t *>());
+			links[l].push_back(&boards[i]);
+		}
+
+		bool log_prefix = boards.size() > 1;
+
+		if (links.size() == 1) {
+			link_worker(links[0], &opts, log_prefix);
+		}
+		else {
+			std::vector<std::thread> workers;
+			for (size_t l = 0; l < links.size(); l++)
+				workers.push_back(std::thread(link_worker, links[l], &opts, log_prefix));
+			for (size_t l = 0; l < workers.size(); l++)
+				workers[l].join();
+		}
+
+		for (size_t i = 0; i < boards.size(); i++) {
+			if (boards[i].ret != cuhRetCode_Success && ret == cuhRetCode_Success)
+				ret = boards[i].ret;
+		}
+
+		if (boards.size() > 1) {
+			printf("\n%-32s %-8s %10s %8s\n", "BOARD", "RESULT", "TIME [s]", "RETRIES");
+			for (size_t i = 0; i < boards.size(); i++) {
+				char result[16];
+
+				if (boards[i].ret == cuhRetCode_Success)
+					snprintf(result, sizeof(result), "OK");
+				else
+					snprintf(result, sizeof(result), "ERR %d", boards[i].ret);
+				printf("%-32s %-8s %10.1f %8d\n", boards[i].name, result, boards[i].seconds, boards[i].retries);
+			}
+		}
+
+		if (V2495_stats::enabled()) {
+			for (size_t i = 0; i < boards.size(); i++) {
+				char prefix[80];
+
+				snprintf(prefix, sizeof(prefix), "[%s] ", boards[i].name);
+				printf("\n");
+				boards[i].stats.print(stdout, prefix);
+			}
+		}
+		else if (stats_file != NULL) {
+			fprintf(stderr, "Statistics not available: build with V2495_STATS.\n");
+		}
+
+		if (stats_file != NULL) {
+			int err = write_stats_json(stats_file, boards);
+			if (err != cuhRetCode_Success && ret == cuhRetCode_Success)
+				ret = err;
+		}
+	}
+	else if (wm == workMode_DUMP) {
+		V2495_flash* main_flash = NULL;
+		uint32_t offset = 0;
+		uint32_t length = 0;
+
+		if (nargs < 1) {
+			fprintf(stderr, "Too few arguments for dump mode.\n");
+			return usage(progname, cuhRetCode_Usage);
+		}
+		if (boards.size() > 1) {
+			fprintf(stderr, "Dump mode works on a single board.\n");
+			return usage(progname, cuhRetCode_Usage);
+		}
+		if (nargs > 1)
+			offset = strtoul(argv[index + 1], NULL, 0);
+		if (nargs > 2)
+			length = strtoul(argv[index + 2], NULL, 0);
+
+		if (boards.empty())
+			V2495_parse_target("usb:0:0:0", &board.target);
+		else
+			board = boards[0];
+
 		try {
-			main_flash = new V2495_flash(V2495_flash::MAIN_CONTROLLER_OFFSET); // Main flash controller
+			main_flash = new V2495_flash(V2495_flash::MAIN_CONTROLLER_OFFSET, board.target); // Main flash controller
+			main_flash->set_transfer_mode(transfer_mode);
+			main_flash->set_retries(retries);
+			main_flash->dump_firmware(V2495_flash::APPLICATION1_FW_REGION, argv[index], 0, offset, length);
+		}
+		catch (cuhRetCode_t err) {
+			fprintf(stderr, "Firmware dump failed with error %d\n", err);
+			ret = err;
+		}
 
-			// *************************************
-			// Application programming 
-			// *************************************
-			printf("Upgrading V2495 application firmware image from file %s....\n", fwfile);
-			main_flash->program_firmware(V2495_flash::APPLICATION1_FW_REGION, fwfile);
+		if (main_flash != NULL)
+			delete main_flash;
+	}
+	else if (wm == workMode_CONFIG_ROM) {
+		V2495_flash* main_flash = NULL;
+
+		if (nargs < 3) {
+			fprintf(stderr, "Too few arguments for configuration ROM mode.\n");
+			return usage(progname, cuhRetCode_Usage);
+		}
+		if (boards.size() > 1) {
+			fprintf(stderr, "Configuration ROM mode works on a single board.\n");
+			return usage(progname, cuhRetCode_Usage);
+		}
+
+		if (boards.empty())
+			V2495_parse_target("usb:0:0:0", &board.target);
+		else
+			board = boards[0];
+
+		try {
+			main_flash = new V2495_flash(V2495_flash::MAIN_CONTROLLER_OFFSET, board.target); // Main flash controller
+			main_flash->set_transfer_mode(transfer_mode);
+			main_flash->set_retries(retries);
+			ret = config_rom_command(main_flash, argv[index], strtoul(argv[index + 1], NULL, 0), argv[index + 2]);
+			if (ret == cuhRetCode_Usage)
+				usage(progname, ret);
 		}
 		catch (cuhRetCode_t err) {
-			fprintf(stderr, "Firmware upgrade failed with error %d\n", err);
+			fprintf(stderr, "Configuration ROM access failed with error %d\n", err);
 			ret = err;
 		}
+
+		if (main_flash != NULL)
+			delete main_flash;
 	}
 	
-	if (main_flash != NULL)
-		delete main_flash;
-	
 	return ret;
 }
 
@@ -26,10 +26,17 @@ enum cuhRetCode_t {
 	cuhRetCode_DirOpen = -14,
 	cuhRetCode_InvalidFilename = -15,
 	cuhRetCode_Read = -16,
+	cuhRetCode_Timeout = -17,
 };
 
 enum workMode_t {
-	workMode_FWUPDATE
+	workMode_FWUPDATE,
+	workMode_DUMP,
+	workMode_BATCH,
+	workMode_ACTIVATE,
+	workMode_REBOOT,
+	workMode_CHECK,
+	workMode_CONFIG_ROM
 };
 
 #endif
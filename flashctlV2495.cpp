@@ -0,0 +1,108 @@
+// flashctlV2495.cpp : client of the flash service daemon (flashdV2495).
+//
+// Sends its arguments as one request and prints the answer. The exit
+// code is the result of the request.
+#include "cvUpgradeV2495.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+
+#define DEFAULT_SOCKET "/tmp/v2495d.sock"
+
+int usage(const char *pname, int retcode) {
+	FILE *dest = (retcode == 0) ? stdout : stderr;
+	fprintf(dest, "Usage: %s [-h] [-S <socket>] <command> [<arguments>]\n", pname);
+	fprintf(dest, "  -h: show this message and exit\n");
+	fprintf(dest, "  -S <socket>: socket of the daemon (default %s)\n", DEFAULT_SOCKET);
+	fprintf(dest, "  Commands: program, verify, repair, dump, erase, reboot, status,\n");
+	fprintf(dest, "  release, close, sessions, shutdown (see flashdV2495 -h)\n");
+
+	return retcode;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *progname = basename(argv[0]);
+	const char *socket_path = DEFAULT_SOCKET;
+	struct sockaddr_un addr;
+	std::string request;
+	char line[1024];
+	int32_t ret = cuhRetCode_Comm;
+	FILE *in;
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "+hS:")) != -1)
+	switch (c)
+	{
+	case 'h':
+		return usage(progname, cuhRetCode_Success);
+	case 'S':
+		socket_path = optarg;
+		break;
+	default:
+		return usage(progname, cuhRetCode_Usage);
+	}
+
+	if (optind >= argc)
+		return usage(progname, cuhRetCode_Usage);
+
+	for (int i = optind; i < argc; i++) {
+		char path[PATH_MAX];
+
+		if (strchr(argv[i], ' ') != NULL) {
+			fprintf(stderr, "Arguments can't contain spaces: %s\n", argv[i]);
+			return cuhRetCode_Usage;
+		}
+		if (!request.empty())
+			request += " ";
+
+		// The file of program/verify/repair/dump is opened by the daemon,
+		// in its own working directory
+		if (i - optind == 4 && strcmp(argv[optind], "reboot") != 0 && argv[i][0] != '/' && getcwd(path, sizeof(path)) != NULL) {
+			request += path;
+			request += "/";
+		}
+		request += argv[i];
+	}
+	request += "\n";
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s too long.\n", socket_path);
+		return cuhRetCode_Usage;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Can't connect to %s, is flashdV2495 running?\n", socket_path);
+		if (fd >= 0)
+			close(fd);
+		return cuhRetCode_Open;
+	}
+
+	if (write(fd, request.c_str(), request.size()) != (ssize_t)request.size()) {
+		fprintf(stderr, "Error sending the request.\n");
+		close(fd);
+		return cuhRetCode_Comm;
+	}
+
+	in = fdopen(fd, "r");
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (strncmp(line, "RESULT ", 7) == 0)
+			ret = atoi(line + 7);
+		else
+			fputs(line, stdout);
+	}
+	fclose(in);
+
+	return ret;
+}
@@ -0,0 +1,539 @@
+// flashdV2495.cpp : flash service daemon.
+//
+// Keeps the V2495 boards open between requests, so that scripts running
+// many small operations (status, verify, erase...) don't pay for opening
+// the link, reading the IDCODE and deconfiguring the FPGA every time.
+// Requests come from flashctlV2495 over a Unix domain socket.
+//
+// Protocol: the client sends one line, "<command> <arguments>" separated
+// by spaces. The daemon answers with the messages of the operation and a
+// last line "RESULT <code>" (a cuhRetCode_t), then closes the connection.
+//
+// The flash of a board is taken from the FPGA at the first operation that
+// needs it, and given back after some idle time (or with "release"), so
+// that the FPGA runs again between bursts of requests. Requests for the
+// same board are served in order, different boards at the same time.
+#include "V2495_flash.h"
+#include "V2495_sim.h"
+#include "cvUpgradeV2495.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <map>
+#include <string>
+#include <vector>
+
+#define DEFAULT_SOCKET "/tmp/v2495d.sock"
+#define MAX_REQUEST 4096
+
+typedef std::chrono::steady_clock daemon_clock;
+
+// A board kept open by the daemon. The transport and the flash objects
+// are created at the first request that needs them.
+typedef struct {
+	std::string name;
+	std::mutex lock;
+	V2495_transport *transport;
+	V2495_flash *flash[2]; // main, user
+	daemon_clock::time_point last_used;
+} session_t;
+
+static std::mutex sessions_lock;
+static std::map<std::string, std::shared_ptr<session_t> > sessions;
+
+static int listen_fd = -1;
+static volatile sig_atomic_t stopping = 0;
+static int idle_seconds = 10;
+static int retries = 5;
+
+static std::shared_ptr<session_t> get_session(const char *name) {
+	std::lock_guard<std::mutex> guard(sessions_lock);
+	std::shared_ptr<session_t>& session = sessions[name];
+
+	if (!session) {
+		session = std::make_shared<session_t>();
+		session->name = name;
+		session->transport = NULL;
+		session->flash[0] = NULL;
+		session->flash[1] = NULL;
+		session->last_used = daemon_clock::now();
+	}
+	return session;
+}
+
+// Close the board (called with the session locked)
+static void close_session(session_t *session) {
+	for (int c = 0; c < 2; c++) {
+		if (session->flash[c] != NULL) {
+			delete session->flash[c];
+			session->flash[c] = NULL;
+		}
+	}
+	if (session->transport != NULL) {
+		delete session->transport;
+		session->transport = NULL;
+	}
+}
+
+// Flash object of a controller, opening the board if needed (session locked).
+// "sim" is a simulated board, to try out scripts without hardware.
+static V2495_flash *get_flash(session_t *session, int user) {
+	if (session->transport == NULL) {
+		V2495_target_t target;
+
+		if (session->name == "sim") {
+			session->transport = new V2495_sim();
+		}
+		else {
+			if (!V2495_parse_target(session->name.c_str(), &target))
+				throw cuhRetCode_Usage;
+			session->transport = new V2495_CAENComm_transport(target);
+		}
+		printf("%s: opened\n", session->name.c_str());
+	}
+
+	if (session->flash[user] == NULL) {
+		V2495_flash::controller_t controller = user ? V2495_flash::USER_CONTROLLER_OFFSET : V2495_flash::MAIN_CONTROLLER_OFFSET;
+
+		session->flash[user] = new V2495_flash(controller, session->transport);
+		session->flash[user]->set_retries(retries);
+	}
+
+	// The flash may have been given back to the FPGA while idle
+	session->flash[user]->acquire_flash_access();
+	return session->flash[user];
+}
+
+static int parse_controller(const char *name, int *user) {
+	if (strcmp(name, "main") == 0)
+		*user = 0;
+	else if (strcmp(name, "user") == 0)
+		*user = 1;
+	else
+		return 0;
+	return 1;
+}
+
+// Operations on a flash: <command> <target> <main|user> <region> [<file> [verify]]
+static int32_t flash_request(session_t *session, int argc, char **argv, FILE *out) {
+	const char *command = argv[0];
+	V2495_flash::fw_region_t region;
+	V2495_flash *flash;
+	char *file = (argc > 4) ? argv[4] : NULL;
+	int user;
+
+	if (argc < 4 || !parse_controller(argv[2], &user) || !V2495_flash::parse_region(argv[3], &region)) {
+		fprintf(out, "Usage: %s <target> <main|user> <boot|app1..app5>%s\n", command,
+		        (strcmp(command, "erase") == 0) ? "" : " <file>");
+		return cuhRetCode_Usage;
+	}
+	if (strcmp(command, "erase") != 0 && file == NULL) {
+		fprintf(out, "%s needs a file.\n", command);
+		return cuhRetCode_Usage;
+	}
+
+	flash = get_flash(session, user);
+	flash->set_log_stream(out);
+
+	try {
+		if (strcmp(command, "program") == 0)
+			flash->program_firmware(region, file, argc > 5 && strcmp(argv[5], "verify") == 0);
+		else if (strcmp(command, "verify") == 0)
+			flash->verify_firmware(region, file);
+		else if (strcmp(command, "repair") == 0)
+			flash->repair_firmware(region, file);
+		else if (strcmp(command, "dump") == 0)
+			flash->dump_firmware(region, file);
+		else
+			flash->erase_firmware(region);
+	}
+	catch (cuhRetCode_t err) {
+		flash->set_log_stream(NULL);
+		throw;
+	}
+	flash->set_log_stream(NULL);
+
+	return cuhRetCode_Success;
+}
+
+// Reboot of an FPGA:
+// reboot <target> <main|user> <region> <address>:<mask>:<value> [<timeout_ms>]
+static int32_t reboot_request(session_t *session, int argc, char **argv, FILE *out) {
+	V2495_flash::fw_region_t region;
+	V2495_flash *flash;
+	uint32_t health[3];
+	uint32_t timeout_ms = (argc > 5) ? atoi(argv[5]) : 2000;
+	int user;
+
+	if (argc < 5 || !parse_controller(argv[2], &user) || !V2495_flash::parse_region(argv[3], &region) ||
+	    sscanf(argv[4], "%x:%x:%x", &health[0], &health[1], &health[2]) != 3) {
+		fprintf(out, "Usage: reboot <target> <main|user> <boot|app1..app5> <address>:<mask>:<value> [<timeout_ms>]\n");
+		return cuhRetCode_Usage;
+	}
+
+	flash = get_flash(session, user);
+	flash->set_health_check(health[0], health[1], health[2]);
+	flash->set_log_stream(out);
+
+	try {
+		flash->reboot_with_rollback(region, timeout_ms);
+	}
+	catch (cuhRetCode_t err) {
+		flash->set_log_stream(NULL);
+		throw;
+	}
+	flash->set_log_stream(NULL);
+
+	return cuhRetCode_Success;
+}
+
+static int32_t status_request(session_t *session, int argc, char **argv, FILE *out) {
+	int first = 0, last = 1;
+
+	if (argc > 2) {
+		if (!parse_controller(argv[2], &first)) {
+			fprintf(out, "Usage: status <target> [main|user]\n");
+			return cuhRetCode_Usage;
+		}
+		last = first;
+	}
+
+	for (int user = first; user <= last; user++) {
+		uint32_t status;
+
+		// Opening the controller is what finds it missing
+		try {
+			get_flash(session, user)->get_flash_status(&status);
+		}
+		catch (cuhRetCode_t err) {
+			if (err != cuhRetCode_ControllerNotPresent)
+				throw;
+			fprintf(out, "%s: controller not present\n", user ? "user" : "main");
+			continue;
+		}
+		fprintf(out, "%s: flash status 0x%02X\n", user ? "user" : "main", status & 0xFF);
+	}
+	return cuhRetCode_Success;
+}
+
+static int32_t board_request(int argc, char **argv, FILE *out) {
+	const char *command = argv[0];
+	int32_t ret = cuhRetCode_Success;
+
+	if (argc < 2) {
+		fprintf(out, "Usage: %s <target> ...\n", command);
+		return cuhRetCode_Usage;
+	}
+
+	V2495_target_t target;
+
+	if (strcmp(argv[1], "sim") != 0 && !V2495_parse_target(argv[1], &target)) {
+		fprintf(out, "Invalid target %s.\n", argv[1]);
+		return cuhRetCode_Usage;
+	}
+
+	std::shared_ptr<session_t> session = get_session(argv[1]);
+	std::lock_guard<std::mutex> guard(session->lock);
+
+	try {
+		if (strcmp(command, "status") == 0) {
+			ret = status_request(session.get(), argc, argv, out);
+		}
+		else if (strcmp(command, "release") == 0) {
+			for (int c = 0; c < 2; c++) {
+				if (session->flash[c] != NULL)
+					session->flash[c]->release_flash_access();
+			}
+		}
+		else if (strcmp(command, "close") == 0) {
+			close_session(session.get());
+			printf("%s: closed\n", session->name.c_str());
+		}
+		else if (strcmp(command, "program") == 0 || strcmp(command, "verify") == 0 || strcmp(command, "repair") == 0 ||
+		         strcmp(command, "dump") == 0 || strcmp(command, "erase") == 0) {
+			ret = flash_request(session.get(), argc, argv, out);
+		}
+		else if (strcmp(command, "reboot") == 0) {
+			ret = reboot_request(session.get(), argc, argv, out);
+		}
+		else {
+			fprintf(out, "Unknown command %s.\n", command);
+			ret = cuhRetCode_Usage;
+		}
+	}
+	catch (cuhRetCode_t err) {
+		fprintf(out, "%s failed with error %d\n", command, err);
+		ret = err;
+		// The link state is unknown: open it again at the next request
+		if (err == cuhRetCode_Comm || err == cuhRetCode_Open || err == cuhRetCode_Timeout) {
+			close_session(session.get());
+			printf("%s: closed after error %d\n", session->name.c_str(), err);
+		}
+	}
+
+	session->last_used = daemon_clock::now();
+	return ret;
+}
+
+static int32_t run_request(int argc, char **argv, FILE *out) {
+	if (argc == 0) {
+		fprintf(out, "Empty request.\n");
+		return cuhRetCode_Usage;
+	}
+
+	if (strcmp(argv[0], "sessions") == 0) {
+		std::lock_guard<std::mutex> guard(sessions_lock);
+
+		for (std::map<std::string, std::shared_ptr<session_t> >::iterator i = sessions.begin(); i != sessions.end(); ++i) {
+			session_t *session = i->second.get();
+			double idle = std::chrono::duration<double>(daemon_clock::now() - session->last_used).count();
+
+			fprintf(out, "%-32s %-6s idle %.0f s\n", session->name.c_str(),
+			        (session->transport != NULL) ? "open" : "closed", idle);
+		}
+		return cuhRetCode_Success;
+	}
+
+	if (strcmp(argv[0], "shutdown") == 0) {
+		stopping = 1;
+		shutdown(listen_fd, SHUT_RDWR);
+		return cuhRetCode_Success;
+	}
+
+	return board_request(argc, argv, out);
+}
+
+static void serve_client(int fd) {
+	char request[MAX_REQUEST];
+	size_t length = 0;
+	std::vector<char *> args;
+	char *save = NULL;
+	FILE *out;
+	int32_t ret;
+
+	// One line
+	while (length < sizeof(request) - 1) {
+		ssize_t n = read(fd, request + length, 1);
+
+		if (n <= 0 || request[length] == '\n')
+			break;
+		length++;
+	}
+	request[length] = '\0';
+	if (length > 0)
+		printf("request: %s\n", request);
+
+	for (char *p = strtok_r(request, " \t\r", &save); p != NULL; p = strtok_r(NULL, " \t\r", &save))
+		args.push_back(p);
+
+	out = fdopen(fd, "w");
+	if (out == NULL) {
+		close(fd);
+		return;
+	}
+	setvbuf(out, NULL, _IOLBF, 0);
+
+	ret = run_request((int)args.size(), args.empty() ? NULL : &args[0], out);
+
+	fprintf(out, "RESULT %d\n", ret);
+	fclose(out);
+}
+
+// Give the flash back to the FPGA of the boards idle for idle_seconds
+static void idle_worker() {
+	while (!stopping) {
+		std::vector<std::shared_ptr<session_t> > list;
+
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		{
+			std::lock_guard<std::mutex> guard(sessions_lock);
+			for (std::map<std::string, std::shared_ptr<session_t> >::iterator i = sessions.begin(); i != sessions.end(); ++i)
+				list.push_back(i->second);
+		}
+
+		for (size_t i = 0; i < list.size(); i++) {
+			session_t *session = list[i].get();
+			std::unique_lock<std::mutex> guard(session->lock, std::try_to_lock);
+
+			if (!guard.owns_lock() || daemon_clock::now() - session->last_used < std::chrono::seconds(idle_seconds))
+				continue;
+
+			for (int c = 0; c < 2; c++) {
+				if (session->flash[c] == NULL || !session->flash[c]->has_flash_access())
+					continue;
+				try {
+					session->flash[c]->release_flash_access();
+					printf("%s: %s flash released\n", session->name.c_str(), c ? "user" : "main");
+				}
+				catch (cuhRetCode_t err) {
+					printf("%s: error %d releasing the flash\n", session->name.c_str(), err);
+					close_session(session);
+				}
+			}
+		}
+	}
+}
+
+// Remove the socket left by a previous daemon. Anything else at path (a
+// file, a link, a daemon still listening) is left alone.
+static int remove_stale_socket(const char *path) {
+	struct stat st;
+	struct sockaddr_un addr;
+	int fd;
+
+	if (lstat(path, &st) != 0)
+		return 1;
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s exists and is not a socket.\n", path);
+		return 0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		close(fd);
+		fprintf(stderr, "Another daemon is listening on %s.\n", path);
+		return 0;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return unlink(path) == 0;
+}
+
+static void stop_handler(int signum) {
+	stopping = 1;
+	shutdown(listen_fd, SHUT_RDWR);
+}
+
+int usage(const char *pname, int retcode) {
+	FILE *dest = (retcode == 0) ? stdout : stderr;
+	fprintf(dest, "Usage: %s [-h] [-S <socket>] [-i <seconds>] [-n <count>]\n", pname);
+	fprintf(dest, "  -h: show this message and exit\n");
+	fprintf(dest, "  -S <socket>: Unix socket to listen on (default %s), accessible\n", DEFAULT_SOCKET);
+	fprintf(dest, "     by the owner only\n");
+	fprintf(dest, "  -i <seconds>: give the flash back to the FPGA of a board idle for\n");
+	fprintf(dest, "     this long (default 10)\n");
+	fprintf(dest, "  -n <count>: retries of a failed transaction before giving up (default 5)\n");
+	fprintf(dest, "Requests (see flashctlV2495):\n");
+	fprintf(dest, "  program <target> <main|user> <region> <file> [verify]\n");
+	fprintf(dest, "  verify|repair|dump <target> <main|user> <region> <file>\n");
+	fprintf(dest, "  erase <target> <main|user> <region>\n");
+	fprintf(dest, "  reboot <target> <main|user> <region> <address>:<mask>:<value> [<timeout_ms>]:\n");
+	fprintf(dest, "     configure the FPGA from region, back to the previous one if the\n");
+	fprintf(dest, "     register at address (hex) under mask isn't value when it comes up\n");
+	fprintf(dest, "     (see --health of cvUpgradeV2495)\n");
+	fprintf(dest, "  status <target> [main|user]\n");
+	fprintf(dest, "  release <target>: give the flash back to the FPGA now\n");
+	fprintf(dest, "  close <target>: close the board\n");
+	fprintf(dest, "  sessions: list the boards\n");
+	fprintf(dest, "  shutdown: stop the daemon\n");
+	fprintf(dest, "  target is <link_type>:<link_num>:<conet_node>:<vme_base> or sim,\n");
+	fprintf(dest, "  region is boot or app1 ... app5\n");
+
+	return retcode;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *progname = basename(argv[0]);
+	const char *socket_path = DEFAULT_SOCKET;
+	struct sockaddr_un addr;
+	struct sigaction action;
+	mode_t old_umask;
+	int c;
+
+	while ((c = getopt(argc, argv, "hi:n:S:")) != -1)
+	switch (c)
+	{
+	case 'h':
+		return usage(progname, cuhRetCode_Success);
+	case 'i':
+		idle_seconds = atoi(optarg);
+		break;
+	case 'n':
+		retries = atoi(optarg);
+		break;
+	case 'S':
+		socket_path = optarg;
+		break;
+	default:
+		return usage(progname, cuhRetCode_Usage);
+	}
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s too long.\n", socket_path);
+		return cuhRetCode_Usage;
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return cuhRetCode_Open;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (!remove_stale_socket(socket_path)) {
+		close(listen_fd);
+		return cuhRetCode_Open;
+	}
+
+	// Requests can rewrite the flash: only the owner may connect
+	old_umask = umask(0077);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(socket_path, 0600) != 0 || listen(listen_fd, 16) != 0) {
+		perror(socket_path);
+		umask(old_umask);
+		close(listen_fd);
+		return cuhRetCode_Open;
+	}
+	umask(old_umask);
+
+	// accept is interrupted by the stop signals (no SA_RESTART)
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_handler;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("Listening on %s\n", socket_path);
+
+	std::thread idle(idle_worker);
+
+	while (!stopping) {
+		int fd = accept(listen_fd, NULL, NULL);
+
+		if (fd < 0)
+			continue;
+		std::thread(serve_client, fd).detach();
+	}
+
+	idle.join();
+	close(listen_fd);
+	unlink(socket_path);
+
+	// Give the flash back to the FPGA of all the boards
+	std::lock_guard<std::mutex> guard(sessions_lock);
+	for (std::map<std::string, std::shared_ptr<session_t> >::iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		std::lock_guard<std::mutex> session_guard(i->second->lock);
+		close_session(i->second.get());
+	}
+	printf("Stopped\n");
+
+	return cuhRetCode_Success;
+}